@@ -0,0 +1,65 @@
+# PlatformIO post-build hook: prints RAM, IRAM and flash usage of the linked image
+# and writes it to <build dir>/size_report.txt so profiles can be compared.
+import subprocess
+
+Import("env")
+
+DRAM_SIZE = 81920
+IRAM_SIZE = 32768
+
+RAM_SECTIONS = (".data", ".rodata", ".bss")
+FLASH_SECTIONS = (".irom0.text", ".text", ".text1", ".data", ".rodata")
+IRAM_SECTIONS = (".text", ".text1")
+IRAM_START, IRAM_END = 0x40100000, 0x40108000
+IRAM_TOP = 12
+HOT_PATH_SYMBOLS = ("composeFrame", "drawDigit", "outputFrame")   # HOT_PATH in src/main.cpp
+
+
+def read_sections(elf):
+    out = subprocess.check_output([env.subst("$SIZETOOL"), "-A", elf]).decode()
+    sections = {}
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) >= 2 and parts[0].startswith(".") and parts[1].isdigit():
+            sections[parts[0]] = int(parts[1])
+    return sections
+
+
+def iram_symbols(elf):
+    # nm lives next to size in the toolchain
+    nm = env.subst("$SIZETOOL")[:-len("size")] + "nm"
+    out = subprocess.check_output([nm, "-S", "-C", "--size-sort", elf]).decode()
+    symbols = []
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) == 4 and IRAM_START <= int(parts[0], 16) < IRAM_END:
+            symbols.append((int(parts[1], 16), parts[3]))
+    return sorted(symbols, reverse=True)
+
+
+def size_report(source, target, env):
+    elf = str(target[0])
+    sections = read_sections(elf)
+    ram = sum(sections.get(s, 0) for s in RAM_SECTIONS)
+    flash = sum(sections.get(s, 0) for s in FLASH_SECTIONS)
+    iram = sum(sections.get(s, 0) for s in IRAM_SECTIONS)
+    lines = [
+        "profile: %s" % env["PIOENV"],
+        "RAM:   %6d bytes (%4.1f%% of %d, %d free for heap/stack)"
+        % (ram, 100.0 * ram / DRAM_SIZE, DRAM_SIZE, DRAM_SIZE - ram),
+        "IRAM:  %6d bytes (%4.1f%% of %d, %d headroom)"
+        % (iram, 100.0 * iram / IRAM_SIZE, IRAM_SIZE, IRAM_SIZE - iram),
+        "Flash: %6d bytes" % flash,
+    ]
+    symbols = iram_symbols(elf)
+    hot = [(size, name) for size, name in symbols if name.split("(")[0] in HOT_PATH_SYMBOLS]
+    lines.append("Frame path in IRAM: %s" % (", ".join("%s %d" % (n.split("(")[0], sz) for sz, n in hot) or "none"))
+    lines.append("Largest IRAM symbols:")
+    lines += ["  %6d  %s" % sym for sym in symbols[:IRAM_TOP]]
+    report = "\n".join(lines) + "\n"
+    print(report)
+    with open(env.subst("$BUILD_DIR/size_report.txt"), "w") as f:
+        f.write(report)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", size_report)
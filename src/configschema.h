@@ -0,0 +1,43 @@
+/*
+  config.json schema versioning for 7sClock. Depends only on ArduinoJson,
+  so the native unit tests in test/ can build it on the host.
+*/
+#pragma once
+
+#include <string.h>
+#include <ArduinoJson.h>
+
+// Layout version of config.json. Files without "schema" are version 0,
+// written before it existed. migrateConfig() brings an older document up
+// to date in place; loadConfig() then saves it once, so later boots skip
+// straight to reading it.
+#define CONFIG_SCHEMA 1
+
+// Timezone spellings that older configs used for the rules the web UI
+// offers; POSIX rules default to a 02:00 transition, so "M3.5.0/2" and
+// "M3.5.0" are the same rule.
+const char *const timezoneAliases[][2] = {
+  {"CET-1CEST,M3.5.0/2,M10.5.0/3", "CET-1CEST,M3.5.0,M10.5.0/3"},
+  {"EST5EDT,M3.2.0,M11.1.0", "EST5EDT,M3.2.0/2,M11.1.0"},
+};
+
+// The canonical spelling of tz, or tz itself if it has no alias
+inline const char *normalizeTimezone(const char *tz) {
+  for (auto &alias : timezoneAliases) {
+    if (!strcmp(tz, alias[0])) return alias[1];
+  }
+  return tz;
+}
+
+// Returns true if the document was older than CONFIG_SCHEMA and was changed
+inline bool migrateConfig(JsonDocument &doc) {
+  int schema = doc["schema"] | 0;
+  if (schema >= CONFIG_SCHEMA) return false;
+  if (schema < 1) {
+    // v0 -> v1: canonical timezone spellings
+    const char *tz = doc["timezone"].as<const char *>();
+    if (tz && normalizeTimezone(tz) != tz) doc["timezone"] = normalizeTimezone(tz);
+  }
+  doc["schema"] = CONFIG_SCHEMA;
+  return true;
+}
@@ -0,0 +1,205 @@
+/*
+  Display effect interpreter for 7sClock. Plain C++ with no Arduino
+  dependencies, so the native tests in test/ and `tools/effectc.py --check`
+  run the same code as the clock.
+
+  Effects are small stack-machine programs that recolor the composed frame
+  before it is output. A program is checked once when it is loaded (known
+  opcodes, operands inside the code, jumps onto instruction starts,
+  registers and inputs in range), so the interpreter only guards the stack
+  and the per-frame instruction budget. Registers persist between frames.
+  tools/effectc.py assembles programs and documents the opcodes.
+*/
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define EFFECT_MAGIC       "7SFX"
+#define EFFECT_VERSION     1
+#define EFFECT_HEADER_SIZE 8       // magic, version, frame period / 10 ms, code length (LE)
+#define EFFECT_CODE_MAX    512
+#define EFFECT_STACK       16
+#define EFFECT_REGS        16
+#define EFFECT_BUDGET      512     // instructions per frame
+#define EFFECT_STRIP_LEDS  15      // pixels per strip, NUM_LEDS on the clock
+
+enum { HOUR_STRIP = 0, MINUTE_STRIP = 1 };
+
+// Digit positions h1 h2 m1 m2 on the strips
+const uint8_t digitStripIndex[4] = {HOUR_STRIP, HOUR_STRIP, MINUTE_STRIP, MINUTE_STRIP};
+const uint8_t digitStartIndex[4] = {8, 1, 1, 8};
+
+enum EffectOp : uint8_t {
+  OP_END, OP_PUSH8, OP_PUSH16, OP_PUSH32, OP_LOAD, OP_STORE, OP_IN,
+  OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_AND, OP_OR, OP_XOR, OP_SHL, OP_SHR,
+  OP_LT, OP_EQ, OP_NOT, OP_DUP, OP_DROP, OP_SWAP, OP_JMP, OP_JZ,
+  OP_PIXEL, OP_GETPX, OP_DIGIT, OP_DOTS, OP_WHEEL, OP_SCALE,
+  OP_COUNT
+};
+
+const uint8_t effectOperandSize[OP_COUNT] = {
+  0, 1, 2, 4, 1, 1, 1,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 2, 2,
+  0, 0, 0, 0, 0, 0
+};
+
+enum EffectInput : uint8_t { IN_HOUR, IN_MINUTE, IN_SECOND, IN_MILLIS, IN_FRAME, IN_COLOR, IN_DOTS, IN_BRIGHTNESS, IN_COUNT };
+
+enum EffectResult : uint8_t { EFFECT_OK, EFFECT_OVERRUN, EFFECT_FAULT };
+
+struct Effect {
+  bool loaded = false;
+  uint16_t frameMs = 50;
+  uint16_t codeLen = 0;
+  uint8_t code[EFFECT_CODE_MAX];
+  int32_t regs[EFFECT_REGS];
+  uint32_t frame = 0;
+};
+
+typedef uint32_t EffectFrame[2][EFFECT_STRIP_LEDS];
+
+inline uint32_t colorWheel(uint8_t pos) {
+  if (pos < 85) return ((uint32_t)(255 - pos * 3) << 16) | ((uint32_t)(pos * 3) << 8);
+  if (pos < 170) {
+    pos -= 85;
+    return ((uint32_t)(255 - pos * 3) << 8) | (pos * 3);
+  }
+  pos -= 170;
+  return ((uint32_t)(pos * 3) << 16) | (255 - pos * 3);
+}
+
+inline uint32_t scaleColor(uint32_t c, uint16_t scale) {
+  return ((((c >> 16) & 0xFF) * scale >> 8) << 16) | ((((c >> 8) & 0xFF) * scale >> 8) << 8) | ((c & 0xFF) * scale >> 8);
+}
+
+#define VM_POP(n)  do { if (sp < (n)) return EFFECT_FAULT; sp -= (n); } while (0)
+#define VM_PUSH(v) do { int32_t v_ = (v); if (sp >= EFFECT_STACK) return EFFECT_FAULT; stack[sp++] = v_; } while (0)
+
+// Runs one frame of a loaded program over `frame`. A frame that runs out of
+// budget is left as far as it got; the caller unloads a program that faults.
+inline EffectResult effectRun(Effect &e, EffectFrame &frame, const int32_t *inputs, uint16_t &steps) {
+  int32_t stack[EFFECT_STACK];
+  int sp = 0;
+  uint16_t pc = 0;
+  const uint8_t *code = e.code;
+  for (steps = 0; steps < EFFECT_BUDGET; steps++) {
+    if (pc >= e.codeLen) return EFFECT_OK;
+    uint8_t op = code[pc++];
+    int32_t a, b;
+    switch (op) {
+      case OP_END: return EFFECT_OK;
+      case OP_PUSH8: VM_PUSH((int8_t)code[pc]); pc += 1; break;
+      case OP_PUSH16: VM_PUSH((int16_t)(code[pc] | code[pc + 1] << 8)); pc += 2; break;
+      case OP_PUSH32: VM_PUSH((int32_t)(code[pc] | code[pc + 1] << 8 | code[pc + 2] << 16 | (uint32_t)code[pc + 3] << 24)); pc += 4; break;
+      case OP_LOAD: VM_PUSH(e.regs[code[pc]]); pc += 1; break;
+      case OP_STORE: VM_POP(1); e.regs[code[pc]] = stack[sp]; pc += 1; break;
+      case OP_IN: VM_PUSH(inputs[code[pc]]); pc += 1; break;
+      case OP_DUP: VM_POP(1); a = stack[sp]; VM_PUSH(a); VM_PUSH(a); break;
+      case OP_DROP: VM_POP(1); break;
+      case OP_SWAP: VM_POP(2); a = stack[sp]; stack[sp] = stack[sp + 1]; stack[sp + 1] = a; sp += 2; break;
+      case OP_NOT: VM_POP(1); VM_PUSH(!stack[sp]); break;
+      case OP_JMP: pc = code[pc] | code[pc + 1] << 8; break;
+      case OP_JZ:
+        VM_POP(1);
+        pc = stack[sp] ? pc + 2 : (code[pc] | code[pc + 1] << 8);
+        break;
+      case OP_GETPX:
+        VM_POP(1);
+        a = stack[sp];
+        if (a < 0 || a >= 2 * EFFECT_STRIP_LEDS) return EFFECT_FAULT;
+        VM_PUSH(frame[a / EFFECT_STRIP_LEDS][a % EFFECT_STRIP_LEDS]);
+        break;
+      case OP_PIXEL:
+        VM_POP(2);
+        a = stack[sp];
+        if (a < 0 || a >= 2 * EFFECT_STRIP_LEDS) return EFFECT_FAULT;
+        frame[a / EFFECT_STRIP_LEDS][a % EFFECT_STRIP_LEDS] = stack[sp + 1] & 0xFFFFFF;
+        break;
+      case OP_DIGIT:
+        VM_POP(2);
+        a = stack[sp];
+        if (a < 0 || a > 3) return EFFECT_FAULT;
+        b = stack[sp + 1] & 0xFFFFFF;
+        for (int i = 0; i < 7; i++) {
+          uint32_t &px = frame[digitStripIndex[a]][digitStartIndex[a] + i];
+          if (px) px = b;
+        }
+        break;
+      case OP_DOTS:
+        VM_POP(1);
+        frame[HOUR_STRIP][0] = frame[MINUTE_STRIP][0] = stack[sp] & 0xFFFFFF;
+        break;
+      case OP_WHEEL: VM_POP(1); VM_PUSH(colorWheel(stack[sp])); break;
+      case OP_SCALE:
+        VM_POP(2);
+        b = stack[sp + 1] < 0 ? 0 : stack[sp + 1] > 256 ? 256 : stack[sp + 1];
+        VM_PUSH(scaleColor(stack[sp], b));
+        break;
+      default:   // two-operand arithmetic
+        VM_POP(2);
+        a = stack[sp];
+        b = stack[sp + 1];
+        switch (op) {
+          // Arithmetic wraps at 32 bits; INT32_MIN / -1 wraps to INT32_MIN
+          case OP_ADD: a = (int32_t)((uint32_t)a + (uint32_t)b); break;
+          case OP_SUB: a = (int32_t)((uint32_t)a - (uint32_t)b); break;
+          case OP_MUL: a = (int32_t)((uint32_t)a * (uint32_t)b); break;
+          case OP_DIV: a = b == -1 ? (int32_t)(0u - (uint32_t)a) : b ? a / b : 0; break;
+          case OP_MOD: a = b && b != -1 ? a % b : 0; break;
+          case OP_AND: a &= b; break;
+          case OP_OR: a |= b; break;
+          case OP_XOR: a ^= b; break;
+          case OP_SHL: a = (uint32_t)a << (b & 31); break;
+          case OP_SHR: a = (uint32_t)a >> (b & 31); break;
+          case OP_LT: a = a < b; break;
+          case OP_EQ: a = a == b; break;
+          default: return EFFECT_FAULT;
+        }
+        VM_PUSH(a);
+        break;
+    }
+  }
+  return EFFECT_OVERRUN;
+}
+
+#undef VM_POP
+#undef VM_PUSH
+
+// Static checks that make the unchecked operand and jump reads above safe
+inline bool effectValidate(const uint8_t *code, uint16_t len) {
+  uint8_t starts[EFFECT_CODE_MAX / 8] = {};
+  for (uint16_t pc = 0; pc < len;) {
+    uint8_t op = code[pc];
+    if (op >= OP_COUNT) return false;
+    starts[pc >> 3] |= 1 << (pc & 7);
+    pc += 1 + effectOperandSize[op];
+    if (pc > len) return false;
+    if ((op == OP_LOAD || op == OP_STORE) && code[pc - 1] >= EFFECT_REGS) return false;
+    if (op == OP_IN && code[pc - 1] >= IN_COUNT) return false;
+  }
+  for (uint16_t pc = 0; pc < len; pc += 1 + effectOperandSize[code[pc]]) {
+    if (code[pc] != OP_JMP && code[pc] != OP_JZ) continue;
+    uint16_t target = code[pc + 1] | code[pc + 2] << 8;
+    if (target >= len || !(starts[target >> 3] & (1 << (target & 7)))) return false;
+  }
+  return true;
+}
+
+// Loads a program in the upload format (header + code) into `e` with
+// cleared registers. Leaves `e` untouched when the program is rejected.
+inline bool effectParse(Effect &e, const uint8_t *data, size_t len) {
+  if (len < EFFECT_HEADER_SIZE || memcmp(data, EFFECT_MAGIC, 4) || data[4] != EFFECT_VERSION) return false;
+  uint16_t codeLen = data[6] | data[7] << 8;
+  if (codeLen == 0 || codeLen > EFFECT_CODE_MAX || codeLen != len - EFFECT_HEADER_SIZE) return false;
+  if (!effectValidate(data + EFFECT_HEADER_SIZE, codeLen)) return false;
+  memcpy(e.code, data + EFFECT_HEADER_SIZE, codeLen);
+  e.codeLen = codeLen;
+  e.frameMs = data[5] * 10 < 20 ? 20 : data[5] * 10 > 1000 ? 1000 : data[5] * 10;
+  memset(e.regs, 0, sizeof(e.regs));
+  e.frame = 0;
+  e.loaded = true;
+  return true;
+}
@@ -1,6 +1,6 @@
 /*
   7sClock: A smart 7-segment LED clock using ESP8266
-  - WiFiManager for WiFi + config portal
+  - SoftAP provisioning API for WiFi setup, roaming between known networks
   - NTP time sync with automatic DST using TZ strings
   - Custom LED segment control for hours/minutes
   - Configurable via web interface (colors, brightness, blink, 24h, sync interval)
@@ -10,16 +10,55 @@
 */
 
 #include <ESP8266WiFi.h>
-#include <ESPAsyncWiFiManager.h>
+#include <DNSServer.h>
+#include <WiFiUdp.h>
 #include <time.h>
+#include <sys/time.h>
 #include <Adafruit_NeoPixel.h>
 #include <ESPAsyncWebServer.h>
 #include <FS.h>
 #include <LittleFS.h>
 #include <ArduinoJson.h>
 #include <ESP8266mDNS.h>
+#include <coredecls.h>
+#include <flash_hal.h>
+#include "timeutil.h"
+#include "configschema.h"
+#include "effectvm.h"
+
+// Feature profiles, selected per environment in platformio.ini.
+// Setting a flag to 0 drops the subsystem, its handlers and its library.
+#ifndef FEATURE_WEB_UI
+#define FEATURE_WEB_UI 1        // full HTML settings page and confirmation pages
+#endif
+#ifndef FEATURE_WEB_OTA
+#define FEATURE_WEB_OTA 1       // firmware upload via POST /update
+#endif
+#ifndef FEATURE_ARDUINO_OTA
+#define FEATURE_ARDUINO_OTA 1   // espota uploads from the IDE / PlatformIO
+#endif
+#ifndef FEATURE_SSDP
+#define FEATURE_SSDP 1          // SSDP announcement and /description.xml
+#endif
+#ifndef FEATURE_UPNP
+#define FEATURE_UPNP 1          // UPnP ClockControl SOAP service
+#endif
+#ifndef FEATURE_NTP_SERVER
+#define FEATURE_NTP_SERVER 1    // optional SNTP server for the LAN (config.ntpServerMode)
+#endif
+#ifndef FEATURE_KEEPALIVE_API
+#define FEATURE_KEEPALIVE_API 1 // persistent, pipelined HTTP/1.1 for the JSON API on port 8080
+#endif
+#ifndef FEATURE_FLEET
+#define FEATURE_FLEET 1         // /fleet overview of the clocks found via mDNS (config.fleet)
+#endif
+
+#if FEATURE_ARDUINO_OTA
 #include <ArduinoOTA.h>
+#endif
+#if FEATURE_SSDP
 #include <ESP8266SSDP.h>
+#endif
 
 
 #define HOUR_PIN    D2
@@ -29,155 +68,3156 @@
 Adafruit_NeoPixel hourStrip(NUM_LEDS, HOUR_PIN, NEO_GRB + NEO_KHZ800);
 Adafruit_NeoPixel minuteStrip(NUM_LEDS, MINUTE_PIN, NEO_GRB + NEO_KHZ800);
 
-AsyncWebServer server(80);
-DNSServer dns;
+AsyncWebServer server(80);
+DNSServer dns;
+
+// Digits 0-9, then GLYPH_DASH (middle segment only)
+#define GLYPH_DASH 10
+
+const uint8_t segmentMap[11] = {
+    0b1111110, 0b0110000, 0b1101101, 0b1111001, 0b0110011,
+    0b1011011, 0b1011111, 0b1110000, 0b1111111, 0b1111011,
+    0b0000001
+};
+
+const uint8_t minuteSegmentMap[11] = {
+    0b1110111, 0b0010010, 0b1011101, 0b1011011, 0b0111010,
+    0b1101011, 0b1101111, 0b1010010, 0b1111111, 0b1111011,
+    0b0001000
+};
+
+struct ClockConfig {
+  String timezone = "CET-1CEST,M3.5.0,M10.5.0/3";
+  String ntpServer = "pool.ntp.org";
+  bool blinkDots = true;
+  uint8_t brightness = 50;
+  String segmentColor = "#FF0000";
+  bool use24h = false;
+  bool hideLeadingZero24h = false;
+  bool autoDim = true;
+  uint8_t dimStartHour = 22;
+  uint8_t dimEndHour = 6;
+  uint32_t ntpSyncInterval = 60;
+  bool ntpServerMode = false;
+  String timeFallbackUrl = "";   // HTTP server whose Date header is used when NTP is unreachable
+  uint8_t leapSmearHours = 24;   // leap second smear window, 0 steps the clock at midnight
+  String theme = "solid";        // solid, digits or gradient, see compileTheme()
+  String digitColors = "";       // theme "digits": four comma-separated colors, empty uses color
+  String gradientColor = "#0000FF";   // theme "gradient" runs from color to this
+  String dotColor = "";          // empty: the dots follow the theme
+  bool nightShift = false;       // blend the theme toward nightColor at night
+  String nightColor = "#FF2000";
+  uint8_t nightStart = 21;       // fully shifted from nightStart to nightEnd (hours)
+  uint8_t nightEnd = 7;
+  uint8_t nightFade = 90;        // minutes to fade in before nightStart and out after nightEnd
+  String hourWhite = "#FFFFFF";  // per-strip white point: what each strip shows for white
+  String minuteWhite = "#FFFFFF";
+  float gamma = 1.0;             // display gamma, 1.0 leaves colors linear
+  String syslogHost = "";        // RFC 5424 collector, empty disables forwarding
+  uint16_t syslogPort = 514;
+  int8_t wifiRoamRssi = -75;     // below this signal (dBm) look for a stronger known AP
+  bool fleet = false;            // collect the other clocks' status for /fleet
+};
+
+ClockConfig config;
+bool dotState = true;
+
+void configToJson(const ClockConfig &c, JsonObject out) {
+  out["timezone"] = c.timezone;
+  out["ntpServer"] = c.ntpServer;
+  out["blinkDots"] = c.blinkDots;
+  out["brightness"] = c.brightness;
+  out["color"] = c.segmentColor;
+  out["use24h"] = c.use24h;
+  out["hideLeadingZero24h"] = c.hideLeadingZero24h;
+  out["autoDim"] = c.autoDim;
+  out["dimStart"] = c.dimStartHour;
+  out["dimEnd"] = c.dimEndHour;
+  out["ntpSyncInterval"] = c.ntpSyncInterval;
+  out["ntpServerMode"] = c.ntpServerMode;
+  out["timeFallbackUrl"] = c.timeFallbackUrl;
+  out["leapSmearHours"] = c.leapSmearHours;
+  out["theme"] = c.theme;
+  out["digitColors"] = c.digitColors;
+  out["gradientColor"] = c.gradientColor;
+  out["dotColor"] = c.dotColor;
+  out["nightShift"] = c.nightShift;
+  out["nightColor"] = c.nightColor;
+  out["nightStart"] = c.nightStart;
+  out["nightEnd"] = c.nightEnd;
+  out["nightFade"] = c.nightFade;
+  out["hourWhite"] = c.hourWhite;
+  out["minuteWhite"] = c.minuteWhite;
+  out["gamma"] = c.gamma;
+  out["syslogHost"] = c.syslogHost;
+  out["syslogPort"] = c.syslogPort;
+  out["wifiRoamRssi"] = c.wifiRoamRssi;
+  out["fleet"] = c.fleet;
+}
+
+// Bumped by every change (configCommit()) and stored with the config, so
+// clients can tell whether it changed since they last read it
+uint32_t configGeneration = 0;
+
+void saveConfig() {
+  File f = LittleFS.open("/config.json", "w");
+  if (f) {
+    JsonDocument doc;
+    configToJson(config, doc.to<JsonObject>());
+    doc["schema"] = CONFIG_SCHEMA;
+    doc["generation"] = configGeneration;
+    serializeJson(doc, f);
+    f.close();
+  }
+}
+
+int configMigratedFrom = -1;   // schema migrated at boot, -1 if none
+
+// Missing keys take the ClockConfig defaults, so a partial file means the
+// same as a fresh install for everything it leaves out
+void configFromJson(JsonObjectConst in, ClockConfig &c) {
+  const ClockConfig d;
+  c.timezone = in["timezone"] | d.timezone;
+  c.ntpServer = in["ntpServer"] | d.ntpServer;
+  c.blinkDots = in["blinkDots"] | d.blinkDots;
+  c.brightness = in["brightness"] | d.brightness;
+  c.segmentColor = in["color"] | d.segmentColor;
+  c.use24h = in["use24h"] | d.use24h;
+  c.hideLeadingZero24h = in["hideLeadingZero24h"] | d.hideLeadingZero24h;
+  c.autoDim = in["autoDim"] | d.autoDim;
+  c.dimStartHour = in["dimStart"] | d.dimStartHour;
+  c.dimEndHour = in["dimEnd"] | d.dimEndHour;
+  c.ntpSyncInterval = in["ntpSyncInterval"] | d.ntpSyncInterval;
+  c.ntpServerMode = in["ntpServerMode"] | d.ntpServerMode;
+  c.timeFallbackUrl = in["timeFallbackUrl"] | d.timeFallbackUrl;
+  c.leapSmearHours = in["leapSmearHours"] | d.leapSmearHours;
+  c.theme = in["theme"] | d.theme;
+  c.digitColors = in["digitColors"] | d.digitColors;
+  c.gradientColor = in["gradientColor"] | d.gradientColor;
+  c.dotColor = in["dotColor"] | d.dotColor;
+  c.nightShift = in["nightShift"] | d.nightShift;
+  c.nightColor = in["nightColor"] | d.nightColor;
+  c.nightStart = in["nightStart"] | d.nightStart;
+  c.nightEnd = in["nightEnd"] | d.nightEnd;
+  c.nightFade = in["nightFade"] | d.nightFade;
+  c.hourWhite = in["hourWhite"] | d.hourWhite;
+  c.minuteWhite = in["minuteWhite"] | d.minuteWhite;
+  c.gamma = constrain(in["gamma"] | d.gamma, 1.0f, 3.0f);
+  c.syslogHost = in["syslogHost"] | d.syslogHost;
+  c.syslogPort = in["syslogPort"] | d.syslogPort;
+  c.wifiRoamRssi = in["wifiRoamRssi"] | d.wifiRoamRssi;
+  c.fleet = in["fleet"] | d.fleet;
+}
+
+void loadConfig() {
+  if (!LittleFS.exists("/config.json")) return;
+  File f = LittleFS.open("/config.json", "r");
+  if (!f) return;
+  String data = f.readString();
+  f.close();
+  JsonDocument doc;
+  if (deserializeJson(doc, data)) return;
+  int schema = doc["schema"] | 0;
+  bool migrated = migrateConfig(doc);
+  configGeneration = doc["generation"] | 0;
+  configFromJson(doc.as<JsonObjectConst>(), config);
+  if (migrated) {
+    configMigratedFrom = schema;
+    saveConfig();
+  }
+}
+
+bool parseBool(const String &v, bool &out) {
+  if (v == "1" || v == "true" || v == "on") { out = true; return true; }
+  if (v == "0" || v == "false" || v == "off") { out = false; return true; }
+  return false;
+}
+
+bool parseRange(const String &v, long lo, long hi, long &out) {
+  if (v.length() == 0) return false;
+  char *end;
+  out = strtol(v.c_str(), &end, 10);
+  return *end == '\0' && out >= lo && out <= hi;
+}
+
+// Accepts RRGGBB with or without '#' and returns it as #RRGGBB
+bool parseHexColor(String value, String &out) {
+  value.trim();
+  String hex = value.startsWith("#") ? value.substring(1) : value;
+  if (hex.length() != 6) return false;
+  for (unsigned i = 0; i < 6; i++) if (!isxdigit(hex[i])) return false;
+  out = "#" + hex;
+  return true;
+}
+
+// Four comma-separated colors, one per digit (h1 h2 m1 m2), or empty
+bool parseDigitColors(const String &value, String &out) {
+  if (!value.length()) {
+    out = "";
+    return true;
+  }
+  String result;
+  int start = 0;
+  for (int d = 0; d < 4; d++) {
+    int comma = value.indexOf(',', start);
+    if ((d < 3) != (comma >= 0)) return false;
+    String color;
+    if (!parseHexColor(value.substring(start, d < 3 ? comma : value.length()), color)) return false;
+    result += (d ? "," : "") + color;
+    start = comma + 1;
+  }
+  out = result;
+  return true;
+}
+
+// Sets one field by its config.json key. Returns false for unknown keys and
+// out-of-range values, leaving the field untouched.
+bool setConfigField(ClockConfig &c, const String &key, const String &value) {
+  long n;
+  if (key == "timezone") { if (!value.length()) return false; c.timezone = normalizeTimezone(value.c_str()); return true; }
+  if (key == "ntpServer") { if (!value.length()) return false; c.ntpServer = value; return true; }
+  if (key == "timeFallbackUrl") { c.timeFallbackUrl = value; return true; }
+  if (key == "color") return parseHexColor(value, c.segmentColor);
+  if (key == "theme") {
+    if (value != "solid" && value != "digits" && value != "gradient") return false;
+    c.theme = value;
+    return true;
+  }
+  if (key == "digitColors") return parseDigitColors(value, c.digitColors);
+  if (key == "gradientColor") return parseHexColor(value, c.gradientColor);
+  if (key == "dotColor") {
+    if (!value.length()) { c.dotColor = ""; return true; }
+    return parseHexColor(value, c.dotColor);
+  }
+  if (key == "nightColor") return parseHexColor(value, c.nightColor);
+  if (key == "hourWhite") return parseHexColor(value, c.hourWhite);
+  if (key == "minuteWhite") return parseHexColor(value, c.minuteWhite);
+  if (key == "gamma") {
+    char *end;
+    float g = strtof(value.c_str(), &end);
+    if (!value.length() || *end || g < 1.0f || g > 3.0f) return false;
+    c.gamma = g;
+    return true;
+  }
+  if (key == "nightShift") return parseBool(value, c.nightShift);
+  if (key == "nightStart") { if (!parseRange(value, 0, 23, n)) return false; c.nightStart = n; return true; }
+  if (key == "nightEnd") { if (!parseRange(value, 0, 23, n)) return false; c.nightEnd = n; return true; }
+  if (key == "nightFade") { if (!parseRange(value, 0, 240, n)) return false; c.nightFade = n; return true; }
+  if (key == "blinkDots") return parseBool(value, c.blinkDots);
+  if (key == "use24h") return parseBool(value, c.use24h);
+  if (key == "hideLeadingZero24h") return parseBool(value, c.hideLeadingZero24h);
+  if (key == "autoDim") return parseBool(value, c.autoDim);
+  if (key == "ntpServerMode") return parseBool(value, c.ntpServerMode);
+  if (key == "fleet") return parseBool(value, c.fleet);
+  if (key == "brightness") { if (!parseRange(value, 0, 255, n)) return false; c.brightness = n; return true; }
+  if (key == "dimStart") { if (!parseRange(value, 0, 23, n)) return false; c.dimStartHour = n; return true; }
+  if (key == "dimEnd") { if (!parseRange(value, 0, 23, n)) return false; c.dimEndHour = n; return true; }
+  if (key == "ntpSyncInterval") { if (!parseRange(value, 1, 1440, n)) return false; c.ntpSyncInterval = n; return true; }
+  if (key == "leapSmearHours") { if (!parseRange(value, 0, 48, n)) return false; c.leapSmearHours = n; return true; }
+  if (key == "syslogHost") { c.syslogHost = value; return true; }
+  if (key == "syslogPort") { if (!parseRange(value, 1, 65535, n)) return false; c.syslogPort = n; return true; }
+  if (key == "wifiRoamRssi") { if (!parseRange(value, -90, -40, n)) return false; c.wifiRoamRssi = n; return true; }
+  return false;
+}
+
+uint32_t parseColor(String hexColor) {
+  hexColor.replace("#", "");
+  return strtoul(hexColor.c_str(), NULL, 16);
+}
+
+#if FEATURE_UPNP
+String extractTag(const String& xml, const String& tag) {
+  int start = xml.indexOf("<" + tag + ">");
+  int end = xml.indexOf("</" + tag + ">");
+  if (start == -1 || end == -1 || end < start) return "";
+  start += tag.length() + 2;
+  String result = xml.substring(start, end);
+  result.trim();
+  return result;
+}
+
+int extractIntFromTag(const String& xml, const String& tag) {
+  String valueStr = extractTag(xml, tag);
+  return valueStr.length() > 0 ? valueStr.toInt() : 0;
+}
+
+void sendSoapResponse(AsyncWebServerRequest *request, const String& actionName) {
+  String body = "<?xml version=\"1.0\" encoding=\"utf-8\"?>";
+  body += "<soap:Envelope xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\">";
+  body += "<soap:Body>";
+  body += "<u:" + actionName + "Response xmlns:u=\"urn:schemas-upnp-org:service:ClockControl:1\"/>";
+  body += "</soap:Body>";
+  body += "</soap:Envelope>";
+  request->send(200, "text/xml", body);
+}
+#endif
+
+// Serial console output. Everything goes into a bounded ring that is
+// drained only as fast as the UART FIFO accepts it; output that does not
+// fit is dropped (and counted) rather than ever blocking the loop.
+#define CONSOLE_TX_SIZE    1536
+
+char consoleTx[CONSOLE_TX_SIZE];
+size_t consoleTxHead = 0;    // next byte to write
+size_t consoleTxTail = 0;    // next byte to send
+uint32_t consoleTxDropped = 0;
+
+// Queues len bytes, or nothing at all if they do not fit
+bool consoleWrite(const char *data, size_t len) {
+  size_t used = (consoleTxHead - consoleTxTail + CONSOLE_TX_SIZE) % CONSOLE_TX_SIZE;
+  if (len > CONSOLE_TX_SIZE - 1 - used) {
+    consoleTxDropped += len;
+    return false;
+  }
+  for (size_t i = 0; i < len; i++) {
+    consoleTx[consoleTxHead] = data[i];
+    consoleTxHead = (consoleTxHead + 1) % CONSOLE_TX_SIZE;
+  }
+  return true;
+}
+
+void consolePrint(const String &s) {
+  consoleWrite(s.c_str(), s.length());
+}
+
+void consolePrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void consolePrintf(const char *fmt, ...) {
+  char buf[160];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(buf, sizeof(buf), fmt, args);
+  va_end(args);
+  if (len > 0) consoleWrite(buf, min((size_t)len, sizeof(buf) - 1));
+}
+
+void consoleFlush() {
+  while (consoleTxTail != consoleTxHead) {
+    int room = Serial.availableForWrite();
+    if (room <= 0) return;
+    size_t end = consoleTxHead > consoleTxTail ? consoleTxHead : CONSOLE_TX_SIZE;
+    size_t n = min((size_t)room, end - consoleTxTail);
+    Serial.write((const uint8_t *)consoleTx + consoleTxTail, n);
+    consoleTxTail = (consoleTxTail + n) % CONSOLE_TX_SIZE;
+  }
+}
+
+// Monotonic time base for every timing subsystem: 64-bit microseconds
+// since boot from micros64(), which extends the 32-bit counter across its
+// wraps. Interval arithmetic on it never wraps, unlike millis() (49 days)
+// or micros() (71 minutes). loop() reads it once per pass and hands it down.
+inline uint64_t monoUs() {
+  return micros64();
+}
+
+#define SEC_US(s) ((uint64_t)(s) * 1000000)
+#define MS_US(ms) ((uint64_t)(ms) * 1000)
+
+// Name this clock goes by on the network (syslog HOSTNAME, mDNS, fleet
+// view): unique per board, so several clocks on one LAN can be told apart
+const char *clockName() {
+  static char name[16];
+  if (!name[0]) snprintf(name, sizeof(name), "7sclock-%x", ESP.getChipId());
+  return name;
+}
+
+// Syslog forwarding (RFC 5424 over UDP). Log lines at SYSLOG_LEVEL or
+// above are formatted into a fixed ring of newline-terminated records as
+// they are logged; syslogPoll() sends them from loop(), one message per
+// datagram as RFC 5426 requires and at most SYSLOG_SEND_MAX per pass. When
+// the ring is full new records are dropped and counted, so a burst of logs
+// costs a memcpy at most and never waits on the network.
+#define SYSLOG_RING_SIZE    2048
+#define SYSLOG_DATAGRAM_MAX 480         // what every receiver must accept (RFC 5426)
+#define SYSLOG_SEND_MAX     4
+#define SYSLOG_LEVEL        LOG_INFO
+#define SYSLOG_FACILITY     16          // local0
+
+struct SyslogStats {
+  uint32_t queued = 0;
+  uint32_t dropped = 0;
+  uint32_t datagrams = 0;
+};
+
+char syslogRing[SYSLOG_RING_SIZE];
+size_t syslogHead = 0;     // next byte to write
+size_t syslogTail = 0;     // oldest unsent byte
+SyslogStats syslogStats;
+WiFiUDP syslogUdp;
+
+size_t syslogUsed() {
+  return (syslogHead - syslogTail + SYSLOG_RING_SIZE) % SYSLOG_RING_SIZE;
+}
+
+void syslogEnqueue(uint8_t level, const char *msg, size_t len) {
+  static const uint8_t severity[] = {3, 4, 6, 7};   // err, warning, info, debug
+  char header[80];
+  char stamp[32] = "-";
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  if (tv.tv_sec > 1600000000) {
+    struct tm t;
+    gmtime_r(&tv.tv_sec, &t);
+    snprintf(stamp, sizeof(stamp), "%04d-%02d-%02dT%02d:%02d:%02d.%03uZ", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+             t.tm_hour, t.tm_min, t.tm_sec, (unsigned)(tv.tv_usec / 1000));
+  }
+  int hlen = snprintf(header, sizeof(header), "<%u>1 %s %s 7sclock - - - ", SYSLOG_FACILITY * 8 + severity[level], stamp, clockName());
+  len = min(len, (size_t)(SYSLOG_DATAGRAM_MAX - hlen - 1));
+  if (hlen + len + 1 > SYSLOG_RING_SIZE - 1 - syslogUsed()) {
+    syslogStats.dropped++;
+    return;
+  }
+  const char *parts[] = {header, msg, "\n"};
+  size_t lens[] = {(size_t)hlen, len, 1};
+  for (int p = 0; p < 3; p++) {
+    for (size_t i = 0; i < lens[p]; i++) {
+      syslogRing[syslogHead] = parts[p][i];
+      syslogHead = (syslogHead + 1) % SYSLOG_RING_SIZE;
+    }
+  }
+  syslogStats.queued++;
+}
+
+// Logging. LOG() checks the level against the most verbose sink before
+// evaluating its arguments, so nothing is formatted (or allocated) unless
+// the serial console or a subscriber will actually receive it. Remote
+// subscribers attach to the /ws/log WebSocket, each with its own level
+// (send "level debug" etc.); a client whose send queue is full has the
+// message counted as dropped instead of holding up the firmware.
+enum LogLevel : uint8_t { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+#define LOG_LINE_MAX      192
+#define LOG_MAX_CLIENTS   4
+
+struct LogSubscriber {
+  uint32_t clientId = 0;         // 0 marks a free slot
+  uint8_t level = LOG_INFO;
+  uint32_t dropped = 0;          // since the last drop notice was delivered
+  uint32_t droppedTotal = 0;
+};
+
+const char *const logLevelNames[] = {"error", "warn", "info", "debug"};
+
+AsyncWebSocket logSocket("/ws/log");
+LogSubscriber logSubs[LOG_MAX_CLIENTS];
+uint8_t serialLogLevel = LOG_INFO;
+uint8_t logMaxLevel = LOG_INFO;  // most verbose level any sink wants
+
+#define LOG(level, ...) do { if ((level) <= logMaxLevel) logWrite((level), __VA_ARGS__); } while (0)
+
+void logUpdateMaxLevel() {
+  uint8_t maxLevel = serialLogLevel;
+  if (config.syslogHost.length() && SYSLOG_LEVEL > maxLevel) maxLevel = SYSLOG_LEVEL;
+  for (auto &sub : logSubs) {
+    if (sub.clientId && sub.level > maxLevel) maxLevel = sub.level;
+  }
+  logMaxLevel = maxLevel;
+}
+
+int parseLogLevel(const char *name) {
+  for (int i = 0; i <= LOG_DEBUG; i++) {
+    if (!strcmp(name, logLevelNames[i])) return i;
+  }
+  return -1;
+}
+
+void logSendToSubscriber(LogSubscriber &sub, const char *line, size_t len) {
+  AsyncWebSocketClient *client = logSocket.client(sub.clientId);
+  if (!client) return;
+  if (client->queueIsFull()) {
+    sub.dropped++;
+    sub.droppedTotal++;
+    return;
+  }
+  if (sub.dropped) {
+    char notice[40];
+    snprintf(notice, sizeof(notice), "[dropped %u messages]", sub.dropped);
+    client->text(notice);
+    sub.dropped = 0;
+  }
+  client->text(line, len);
+}
+
+void logWrite(uint8_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logWrite(uint8_t level, const char *fmt, ...) {
+  char line[LOG_LINE_MAX];
+  uint32_t ms = monoUs() / 1000;
+  int prefix = snprintf(line, sizeof(line), "[%6u.%03u] %c ", ms / 1000, ms % 1000, "EWID"[level]);
+  va_list args;
+  va_start(args, fmt);
+  int body = vsnprintf(line + prefix, sizeof(line) - prefix, fmt, args);
+  va_end(args);
+  int len = min(prefix + max(body, 0), (int)sizeof(line) - 1);
+  if (level <= SYSLOG_LEVEL && config.syslogHost.length()) syslogEnqueue(level, line + prefix, len - prefix);
+  if (level <= serialLogLevel) {
+    consoleWrite(line, len);
+    consoleWrite("\r\n", 2);
+  }
+  for (auto &sub : logSubs) {
+    if (sub.clientId && level <= sub.level) logSendToSubscriber(sub, line, len);
+  }
+}
+
+void onLogSocketEvent(AsyncWebSocket *, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    for (auto &sub : logSubs) {
+      if (sub.clientId) continue;
+      sub = LogSubscriber();
+      sub.clientId = client->id();
+      logUpdateMaxLevel();
+      return;
+    }
+    client->text("too many log subscribers");
+    client->close();
+  } else if (type == WS_EVT_DISCONNECT) {
+    for (auto &sub : logSubs) {
+      if (sub.clientId == client->id()) sub.clientId = 0;
+    }
+    logUpdateMaxLevel();
+  } else if (type == WS_EVT_DATA) {
+    AwsFrameInfo *info = (AwsFrameInfo *)arg;
+    char msg[24];
+    if (!info->final || info->index != 0 || info->len != len || len >= sizeof(msg)) return;
+    memcpy(msg, data, len);
+    msg[len] = '\0';
+    int level = strncmp(msg, "level ", 6) == 0 ? parseLogLevel(msg + 6) : -1;
+    for (auto &sub : logSubs) {
+      if (sub.clientId != client->id()) continue;
+      if (level >= 0) sub.level = level;
+      client->text(level >= 0 ? "ok" : "usage: level error|warn|info|debug");
+    }
+    logUpdateMaxLevel();
+  }
+}
+
+// Boot profiler: when each setup() stage finished, plus the first frame and
+// the first valid time, in microseconds since boot. The profile lives in
+// RTC user memory, which survives resets (not power loss), so /api/boot
+// shows the previous boot next to the current one. The first 128 bytes of
+// RTC user memory belong to the OTA bootloader, hence BOOT_RTC_OFFSET.
+#define BOOT_RTC_OFFSET 32        // in 4-byte blocks
+#define BOOT_MAGIC      0x7C0B0071
+
+enum BootStage : uint8_t {
+  BOOT_FS, BOOT_CONFIG, BOOT_WIFI, BOOT_MDNS, BOOT_OTA, BOOT_TIME, BOOT_STRIPS, BOOT_SSDP, BOOT_WEB,
+  BOOT_FIRST_FRAME, BOOT_VALID_TIME,
+  BOOT_STAGE_COUNT
+};
+
+const char *const bootStageNames[BOOT_STAGE_COUNT] = {
+  "fs", "config", "wifi", "mdns", "ota", "time", "strips", "ssdp", "web", "firstFrame", "validTime"
+};
+
+struct BootProfile {
+  uint32_t magic;
+  uint32_t bootCount;
+  uint32_t stageUs[BOOT_STAGE_COUNT];   // 0 if not reached (or compiled out)
+  uint32_t crc;
+};
+
+BootProfile bootProfile = {};
+BootProfile bootPrevious = {};   // magic is 0 when there was none
+
+uint32_t bootProfileCrc(const BootProfile &p) {
+  return crc32(&p, offsetof(BootProfile, crc));
+}
+
+void bootProfileBegin() {
+  ESP.rtcUserMemoryRead(BOOT_RTC_OFFSET, (uint32_t *)&bootPrevious, sizeof(bootPrevious));
+  bool valid = bootPrevious.magic == BOOT_MAGIC && bootPrevious.crc == bootProfileCrc(bootPrevious);
+  if (!valid) bootPrevious = {};
+  bootProfile.magic = BOOT_MAGIC;
+  bootProfile.bootCount = valid ? bootPrevious.bootCount + 1 : 1;
+}
+
+void bootProfileMark(BootStage stage) {
+  if (bootProfile.stageUs[stage]) return;
+  bootProfile.stageUs[stage] = max((uint64_t)1, min(monoUs(), (uint64_t)UINT32_MAX));
+  bootProfile.crc = bootProfileCrc(bootProfile);
+  ESP.rtcUserMemoryWrite(BOOT_RTC_OFFSET, (uint32_t *)&bootProfile, sizeof(bootProfile));
+}
+
+// Each stage reports when it ended and how long it took after the last
+// stage that ran before it
+void bootProfileJson(const BootProfile &p, JsonObject out) {
+  out["bootCount"] = p.bootCount;
+  JsonObject stages = out["stages"].to<JsonObject>();
+  uint32_t prev = 0;
+  for (int i = 0; i < BOOT_STAGE_COUNT; i++) {
+    if (!p.stageUs[i]) continue;
+    JsonObject st = stages[bootStageNames[i]].to<JsonObject>();
+    st["atUs"] = p.stageUs[i];
+    if (i < BOOT_FIRST_FRAME) {
+      st["tookUs"] = p.stageUs[i] - prev;
+      prev = p.stageUs[i];
+    }
+  }
+}
+
+// Event log: notable events (boots, WiFi drops, sync failures, config
+// saves, OTA) as fixed records in two LittleFS segments. eventLog() only
+// queues in RAM, so it is safe from WiFi callbacks; eventPoll() appends the
+// queue in one write every few minutes or once it is half full. When the
+// active segment is full the other one is emptied and takes over, which
+// bounds the log at 2 x EVENT_SEGMENT_RECORDS and never rewrites a record.
+#define EVENT_SEGMENT_RECORDS 256
+#define EVENT_QUEUE_MAX       16
+#define EVENT_FLUSH_US        SEC_US(300)
+#define EVENT_PAGE_MAX        100
+
+enum EventType : uint8_t {
+  EV_BOOT,          // arg: reset reason
+  EV_WIFI_UP,
+  EV_WIFI_DOWN,     // arg: disconnect reason
+  EV_SYNC_FAIL,     // arg: 0 DNS, 1 no reply
+  EV_CONFIG_SAVED,  // arg: config generation
+  EV_OTA_START,     // arg: 0 sketch, 1 filesystem
+  EV_OTA_END,
+  EV_OTA_FAIL,      // arg: error code
+  EV_WIFI_ROAM,     // arg: RSSI of the new access point
+  EV_TYPE_COUNT
+};
+
+const char *const eventTypeNames[EV_TYPE_COUNT] = {
+  "boot", "wifiUp", "wifiDown", "syncFail", "configSaved", "otaStart", "otaEnd", "otaFail", "wifiRoam"
+};
+
+struct EventRecord {
+  uint32_t seq;
+  uint32_t unixTime;       // 0 while the clock is not set
+  uint32_t uptimeS;
+  uint8_t type;            // EventType
+  uint8_t reserved[3];
+  int32_t arg;
+};
+
+struct EventStats {
+  uint32_t dropped = 0;
+  uint32_t flushes = 0;
+};
+
+EventRecord eventQueue[EVENT_QUEUE_MAX];
+uint8_t eventQueued = 0;
+uint32_t eventSeq = 0;                 // sequence number of the newest event
+uint8_t eventSegment = 0;              // segment receiving appends
+uint32_t eventSegmentFirst[2] = {};    // first sequence number per segment, 0 if empty
+uint16_t eventSegmentCount[2] = {};
+EventStats eventStats;
+
+const char *eventPath(uint8_t segment) {
+  return segment ? "/events.1" : "/events.0";
+}
+
+void eventLog(EventType type, int32_t arg = 0) {
+  if (eventQueued >= EVENT_QUEUE_MAX) {
+    eventStats.dropped++;
+    return;
+  }
+  time_t t = time(nullptr);
+  EventRecord &r = eventQueue[eventQueued++];
+  r = {};
+  r.seq = ++eventSeq;
+  r.unixTime = t > 1600000000 ? t : 0;
+  r.uptimeS = monoUs() / 1000000;
+  r.type = type;
+  r.arg = arg;
+}
+
+void eventFlush() {
+  uint8_t done = 0;
+  while (done < eventQueued) {
+    if (eventSegmentCount[eventSegment] >= EVENT_SEGMENT_RECORDS) {
+      eventSegment ^= 1;
+      LittleFS.remove(eventPath(eventSegment));
+      eventSegmentFirst[eventSegment] = 0;
+      eventSegmentCount[eventSegment] = 0;
+    }
+    uint8_t n = min((uint32_t)(eventQueued - done), (uint32_t)(EVENT_SEGMENT_RECORDS - eventSegmentCount[eventSegment]));
+    File f = LittleFS.open(eventPath(eventSegment), "a");
+    if (!f) break;
+    f.write((const uint8_t *)&eventQueue[done], n * sizeof(EventRecord));
+    f.close();
+    if (!eventSegmentCount[eventSegment]) eventSegmentFirst[eventSegment] = eventQueue[done].seq;
+    eventSegmentCount[eventSegment] += n;
+    done += n;
+  }
+  if (done) eventStats.flushes++;
+  eventStats.dropped += eventQueued - done;
+  eventQueued = 0;
+}
+
+void eventPoll(uint64_t now) {
+  static uint64_t lastFlush = 0;
+  if (!eventQueued) return;
+  if (eventQueued < EVENT_QUEUE_MAX / 2 && now - lastFlush < EVENT_FLUSH_US) return;
+  eventFlush();
+  lastFlush = now;
+}
+
+// Recovers the segment layout and the newest sequence number at boot, and
+// again after a filesystem image replaced the segments
+void eventLogLoad() {
+  for (uint8_t seg = 0; seg < 2; seg++) {
+    eventSegmentFirst[seg] = 0;
+    eventSegmentCount[seg] = 0;
+    File f = LittleFS.open(eventPath(seg), "r");
+    if (!f) continue;
+    EventRecord r;
+    uint16_t count = min(f.size() / sizeof(EventRecord), (size_t)EVENT_SEGMENT_RECORDS);
+    if (count && f.read((uint8_t *)&r, sizeof(r)) == sizeof(r)) {
+      eventSegmentFirst[seg] = r.seq;
+      eventSegmentCount[seg] = count;
+      eventSeq = max(eventSeq, r.seq + count - 1);
+    }
+    f.close();
+  }
+  eventSegment = eventSegmentFirst[1] > eventSegmentFirst[0] ? 1 : 0;
+}
+
+uint32_t eventOldestSeq() {
+  uint32_t oldest = eventSeq - eventQueued + 1;
+  for (uint8_t seg = 0; seg < 2; seg++) {
+    if (eventSegmentCount[seg] && eventSegmentFirst[seg] < oldest) oldest = eventSegmentFirst[seg];
+  }
+  return oldest;
+}
+
+bool eventRead(uint32_t seq, EventRecord &r) {
+  if (seq == 0 || seq > eventSeq) return false;
+  if (seq > eventSeq - eventQueued) {
+    r = eventQueue[seq - (eventSeq - eventQueued) - 1];
+    return true;
+  }
+  for (uint8_t seg = 0; seg < 2; seg++) {
+    uint32_t first = eventSegmentFirst[seg];
+    if (!eventSegmentCount[seg] || seq < first || seq >= first + eventSegmentCount[seg]) continue;
+    File f = LittleFS.open(eventPath(seg), "r");
+    if (!f) return false;
+    f.seek((seq - first) * sizeof(EventRecord));
+    bool ok = f.read((uint8_t *)&r, sizeof(r)) == sizeof(r) && r.seq == seq;
+    f.close();
+    return ok;
+  }
+  return false;
+}
+
+// /api/events pages newest first and is produced piecewise by the chunked
+// response filler, so a page never exists in RAM as a whole.
+struct EventStream {
+  uint32_t next;           // next sequence number to emit
+  uint32_t oldest;
+  uint16_t remaining;
+  uint8_t stage = 0;       // 0 header, 1 records, 2 footer, 3 done
+  bool emitted = false;
+  char buf[160];
+  size_t len = 0;
+  size_t pos = 0;
+};
+
+void eventStreamFill(EventStream &st) {
+  EventRecord r;
+  st.pos = 0;
+  st.len = 0;
+  if (st.stage == 0) {
+    st.len = snprintf(st.buf, sizeof(st.buf), "{\"newest\":%u,\"events\":[", eventSeq);
+    st.stage = 1;
+    return;
+  }
+  if (st.stage == 1) {
+    if (st.remaining && st.next >= st.oldest && eventRead(st.next, r)) {
+      st.len = snprintf(st.buf, sizeof(st.buf), "%s{\"seq\":%u,\"time\":%u,\"uptime\":%u,\"type\":\"%s\",\"arg\":%d}",
+                        st.emitted ? "," : "",
+                        r.seq, r.unixTime, r.uptimeS, r.type < EV_TYPE_COUNT ? eventTypeNames[r.type] : "unknown", r.arg);
+      st.next--;
+      st.remaining--;
+      st.emitted = true;
+      return;
+    }
+    st.stage = 2;
+  }
+  if (st.stage == 2) {
+    st.len = snprintf(st.buf, sizeof(st.buf), "],\"before\":%u}", st.next >= st.oldest ? st.next + 1 : 0);
+    st.stage = 3;
+  }
+}
+
+// Event bus: state changes are published as typed events and handed to
+// subscribers from loop() only, so WiFi, TCP and upload callbacks can
+// publish without doing the work in their own context. Subscribers are
+// registered once in busSetup() into fixed per-topic lists and run in
+// registration order. A full queue drops the event and counts it.
+#define BUS_QUEUE_MAX        16
+#define BUS_SUBSCRIBERS_MAX  6
+
+enum BusTopic : uint8_t {
+  BUS_CONFIG_CHANGED,   // a: CONFIG_* flags, b: config generation
+  BUS_TIME_SYNCED,      // a: applied offset (us, clamped), b: TimeSourceKind
+  BUS_WIFI_STATE,       // a: 1 up, 0 down, b: disconnect reason
+  BUS_OTA_PROGRESS,     // a: OtaPhase, b: target at start, percent, error code at failure
+  BUS_TOPIC_COUNT
+};
+
+const char *const busTopicNames[BUS_TOPIC_COUNT] = { "config", "time", "wifi", "ota" };
+
+// BUS_CONFIG_CHANGED flags
+#define CONFIG_TIME  0x01   // timezone or time source changed, time setup must rerun
+
+enum OtaPhase : uint8_t { OTA_PHASE_START, OTA_PHASE_PROGRESS, OTA_PHASE_END, OTA_PHASE_FAIL };
+
+struct BusEvent {
+  BusTopic topic;
+  int32_t a;
+  int32_t b;
+};
+
+typedef void (*BusHandler)(const BusEvent &e);
+
+struct BusStats {
+  uint32_t published = 0;
+  uint32_t dropped = 0;
+  uint8_t maxQueued = 0;
+};
+
+BusHandler busSubscribers[BUS_TOPIC_COUNT][BUS_SUBSCRIBERS_MAX] = {};
+BusEvent busQueue[BUS_QUEUE_MAX];
+uint8_t busHead = 0;
+uint8_t busQueued = 0;
+BusStats busStats;
+
+bool busSubscribe(BusTopic topic, BusHandler handler) {
+  for (auto &slot : busSubscribers[topic]) {
+    if (slot) continue;
+    slot = handler;
+    return true;
+  }
+  return false;
+}
+
+void busPublish(BusTopic topic, int32_t a = 0, int32_t b = 0) {
+  if (busQueued >= BUS_QUEUE_MAX) {
+    busStats.dropped++;
+    return;
+  }
+  busQueue[(busHead + busQueued) % BUS_QUEUE_MAX] = {topic, a, b};
+  busQueued++;
+  busStats.published++;
+  if (busQueued > busStats.maxQueued) busStats.maxQueued = busQueued;
+}
+
+// Delivers every queued event; only call from loop() context
+void busDispatch() {
+  while (busQueued) {
+    BusEvent e = busQueue[busHead];
+    busHead = (busHead + 1) % BUS_QUEUE_MAX;
+    busQueued--;
+    for (BusHandler handler : busSubscribers[e.topic]) {
+      if (handler) handler(e);
+    }
+  }
+}
+
+// Server-sent events on /api/stream: every bus event, for browsers and scripts
+AsyncEventSource busStream("/api/stream");
+
+// Restarts are carried out by loop() after the bus has been drained, so
+// events published just before (an OTA finishing) still reach the log
+uint64_t restartAtUs = 0;
+
+void requestRestart() {
+  restartAtUs = monoUs() + SEC_US(1);
+}
+
+// Takes a change already made to config: the generation is bumped here so
+// replies can report it, saving and applying are left to the subscribers
+void configCommit(uint8_t flags) {
+  configGeneration++;
+  busPublish(BUS_CONFIG_CHANGED, flags, configGeneration);
+}
+
+// Known WiFi networks, kept in /wifi.json rather than config.json so that
+// config backups never carry passwords. The station joins the strongest
+// known access point a scan finds and, while connected, rescans whenever
+// the signal is below wifiRoamRssi, moving to a known AP that is clearly
+// better. Scans run asynchronously in the SDK and are only polled from
+// loop(), so the display keeps rendering while the radio scans.
+#define WIFI_NETWORKS_PATH  "/wifi.json"
+#define WIFI_NETWORKS_MAX   8
+#define WIFI_ROAM_CHECK_US  SEC_US(10)
+#define WIFI_ROAM_SCAN_US   SEC_US(120)   // minimum spacing of roaming scans
+#define WIFI_ROAM_MARGIN    8             // dB a candidate must beat the current AP by
+#define WIFI_CONNECT_US     SEC_US(20)    // join attempt and scan timeout
+#define WIFI_LOST_US        SEC_US(15)    // disconnected this long: rescan for any known AP
+#define WIFI_RETRY_US       SEC_US(30)    // rescan interval while nothing known is in range
+
+struct WifiNetwork {
+  String ssid;
+  String pass;
+};
+
+enum WifiPhase : uint8_t { WIFI_IDLE, WIFI_SCANNING, WIFI_CONNECTING, WIFI_CONNECTED };
+
+const char *const wifiPhaseNames[] = { "idle", "scanning", "connecting", "connected" };
+
+struct WifiState {
+  WifiPhase phase = WIFI_IDLE;
+  bool roaming = false;       // the running scan looks for a better AP, not any AP
+  uint64_t phaseUs = 0;
+  uint64_t lastScanUs = 0;
+  uint64_t lastCheckUs = 0;
+  uint64_t downSinceUs = 0;
+  uint32_t scans = 0;
+  uint32_t joins = 0;
+  uint32_t roams = 0;
+  int8_t lastBestRssi = 0;    // strongest known AP in the last scan
+};
+
+WifiNetwork wifiNetworks[WIFI_NETWORKS_MAX];
+uint8_t wifiNetworkCount = 0;
+WifiState wifiState;
+
+void wifiLoadNetworks() {
+  File f = LittleFS.open(WIFI_NETWORKS_PATH, "r");
+  if (!f) return;
+  JsonDocument doc;
+  DeserializationError err = deserializeJson(doc, f);
+  f.close();
+  if (err) return;
+  wifiNetworkCount = 0;
+  for (JsonVariantConst n : doc.as<JsonArrayConst>()) {
+    String ssid = n["ssid"] | "";
+    if (!ssid.length() || wifiNetworkCount >= WIFI_NETWORKS_MAX) continue;
+    wifiNetworks[wifiNetworkCount].ssid = ssid;
+    wifiNetworks[wifiNetworkCount].pass = n["pass"] | "";
+    wifiNetworkCount++;
+  }
+}
+
+void wifiSaveNetworks() {
+  File f = LittleFS.open(WIFI_NETWORKS_PATH, "w");
+  if (!f) return;
+  JsonDocument doc;
+  JsonArray list = doc.to<JsonArray>();
+  for (uint8_t i = 0; i < wifiNetworkCount; i++) {
+    JsonObject n = list.add<JsonObject>();
+    n["ssid"] = wifiNetworks[i].ssid;
+    n["pass"] = wifiNetworks[i].pass;
+  }
+  serializeJson(doc, f);
+  f.close();
+}
+
+int wifiFindNetwork(const String &ssid) {
+  for (uint8_t i = 0; i < wifiNetworkCount; i++) {
+    if (wifiNetworks[i].ssid == ssid) return i;
+  }
+  return -1;
+}
+
+// Adds a network or updates its password. Returns false when the list is full.
+bool wifiAddNetwork(const String &ssid, const String &pass) {
+  if (!ssid.length() || ssid.length() > 32 || pass.length() > 64) return false;
+  int i = wifiFindNetwork(ssid);
+  if (i < 0) {
+    if (wifiNetworkCount >= WIFI_NETWORKS_MAX) return false;
+    i = wifiNetworkCount++;
+    wifiNetworks[i].ssid = ssid;
+  }
+  wifiNetworks[i].pass = pass;
+  wifiSaveNetworks();
+  return true;
+}
+
+bool wifiRemoveNetwork(const String &ssid) {
+  int i = wifiFindNetwork(ssid);
+  if (i < 0) return false;
+  for (; i + 1 < wifiNetworkCount; i++) wifiNetworks[i] = wifiNetworks[i + 1];
+  wifiNetworks[--wifiNetworkCount] = WifiNetwork();
+  wifiSaveNetworks();
+  return true;
+}
+
+void wifiSetPhase(WifiPhase phase, uint64_t now) {
+  wifiState.phase = phase;
+  wifiState.phaseUs = now;
+}
+
+void wifiStartScan(uint64_t now, bool roaming) {
+  WiFi.scanNetworks(true);
+  wifiState.roaming = roaming;
+  wifiState.lastScanUs = now;
+  wifiState.scans++;
+  wifiSetPhase(WIFI_SCANNING, now);
+}
+
+// Joins the strongest known AP in the scan results. While connected that
+// only happens if it is another AP and beats the current one by the margin.
+void wifiScanDone(int found, uint64_t now) {
+  bool connected = WiFi.isConnected();
+  int best = -1;
+  int bestNet = -1;
+  for (int i = 0; i < found; i++) {
+    int k = wifiFindNetwork(WiFi.SSID(i));
+    if (k >= 0 && (best < 0 || WiFi.RSSI(i) > WiFi.RSSI(best))) {
+      best = i;
+      bestNet = k;
+    }
+  }
+  if (best >= 0) {
+    int32_t rssi = WiFi.RSSI(best);
+    wifiState.lastBestRssi = rssi;
+    bool better = !connected || (memcmp(WiFi.BSSID(best), WiFi.BSSID(), 6) && rssi >= WiFi.RSSI() + WIFI_ROAM_MARGIN);
+    if (better) {
+      if (connected) {
+        wifiState.roams++;
+        eventLog(EV_WIFI_ROAM, rssi);
+        LOG(LOG_INFO, "WiFi roaming to %s (%d dBm, was %d dBm)", WiFi.BSSIDstr(best).c_str(), rssi, WiFi.RSSI());
+      }
+      // begin() copies the BSSID, so the scan results can go afterwards
+      WiFi.begin(wifiNetworks[bestNet].ssid.c_str(), wifiNetworks[bestNet].pass.c_str(), WiFi.channel(best), WiFi.BSSID(best));
+      WiFi.scanDelete();
+      wifiSetPhase(WIFI_CONNECTING, now);
+      return;
+    }
+  } else if (!connected) {
+    LOG(LOG_DEBUG, "WiFi scan found no known network (%d APs)", found);
+  }
+  WiFi.scanDelete();
+  wifiSetPhase(connected ? WIFI_CONNECTED : WIFI_IDLE, now);
+}
+
+// Station management when known networks exist; otherwise the SDK's own
+// reconnect to the portal-provisioned network is left alone
+void wifiPoll(uint64_t now) {
+  if (!wifiNetworkCount) return;
+  bool connected = WiFi.isConnected();
+  if (connected) wifiState.downSinceUs = 0;
+  else if (!wifiState.downSinceUs) wifiState.downSinceUs = now;
+  switch (wifiState.phase) {
+    case WIFI_IDLE:
+      if (connected) wifiSetPhase(WIFI_CONNECTED, now);
+      else if (!wifiState.scans || now - wifiState.lastScanUs >= WIFI_RETRY_US) wifiStartScan(now, false);
+      break;
+    case WIFI_SCANNING: {
+      int8_t found = WiFi.scanComplete();
+      if (found == WIFI_SCAN_RUNNING) {
+        if (now - wifiState.phaseUs < WIFI_CONNECT_US) break;
+        found = 0;
+      }
+      wifiScanDone(found < 0 ? 0 : found, now);
+      break;
+    }
+    case WIFI_CONNECTING:
+      if (connected) {
+        wifiState.joins++;
+        wifiSetPhase(WIFI_CONNECTED, now);
+        LOG(LOG_INFO, "WiFi joined %s via %s (%d dBm)", WiFi.SSID().c_str(), WiFi.BSSIDstr().c_str(), WiFi.RSSI());
+      } else if (now - wifiState.phaseUs >= WIFI_CONNECT_US) {
+        wifiSetPhase(WIFI_IDLE, now);
+      }
+      break;
+    case WIFI_CONNECTED:
+      if (!connected) {
+        if (now - wifiState.downSinceUs >= WIFI_LOST_US) wifiStartScan(now, false);
+        break;
+      }
+      if (now - wifiState.lastCheckUs < WIFI_ROAM_CHECK_US) break;
+      wifiState.lastCheckUs = now;
+      if (WiFi.RSSI() < config.wifiRoamRssi && now - wifiState.lastScanUs >= WIFI_ROAM_SCAN_US) wifiStartScan(now, true);
+      break;
+  }
+}
+
+String wifiJson() {
+  JsonDocument doc;
+  doc["phase"] = wifiPhaseNames[wifiState.phase];
+  doc["connected"] = WiFi.isConnected();
+  if (WiFi.isConnected()) {
+    doc["ssid"] = WiFi.SSID();
+    doc["bssid"] = WiFi.BSSIDstr();
+    doc["channel"] = WiFi.channel();
+    doc["rssi"] = WiFi.RSSI();
+  }
+  doc["roamRssi"] = config.wifiRoamRssi;
+  doc["scans"] = wifiState.scans;
+  doc["joins"] = wifiState.joins;
+  doc["roams"] = wifiState.roams;
+  doc["lastBestRssi"] = wifiState.lastBestRssi;
+  JsonArray known = doc["networks"].to<JsonArray>();
+  for (uint8_t i = 0; i < wifiNetworkCount; i++) known.add(wifiNetworks[i].ssid);
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+// Provisioning: with no known network the clock opens the open SoftAP
+// "7sClockSetup" and waits for credentials on /api/provision, while loop()
+// keeps running and the display shows dashes. A DNS catch-all sends phones
+// to the small /setup form. The AP also opens when none of the known
+// networks has given a link for PROVISION_FALLBACK_US (moved house, new
+// router); wifiPoll() keeps scanning meanwhile, so whichever comes first,
+// a known network or new credentials, ends it. Once the station has
+// joined, the AP stays up for a minute so the client can read the result,
+// then closes.
+#define PROVISION_AP_SSID      "7sClockSetup"
+#define PROVISION_JOIN_US      SEC_US(45)       // no link this long after credentials: report failure
+#define PROVISION_LINGER_US    SEC_US(60)
+#define PROVISION_FALLBACK_US  SEC_US(5 * 60)   // no link with the known networks: open the AP too
+
+enum ProvisionState : uint8_t { PROV_OFF, PROV_WAITING, PROV_JOINING, PROV_DONE };
+
+const char *const provisionStateNames[] = { "off", "waiting", "joining", "done" };
+
+struct Provisioning {
+  ProvisionState state = PROV_OFF;
+  uint64_t sinceUs = 0;
+  bool failed = false;        // the last credentials did not produce a link in time
+};
+
+Provisioning provision;
+
+void provisionSetState(ProvisionState state) {
+  provision.state = state;
+  provision.sinceUs = monoUs();
+}
+
+void provisionBegin(const char *reason) {
+  WiFi.mode(WIFI_AP_STA);
+  WiFi.softAP(PROVISION_AP_SSID);
+  dns.start(53, "*", WiFi.softAPIP());
+  provisionSetState(PROV_WAITING);
+  LOG(LOG_INFO, "%s, provisioning on SoftAP %s at %s", reason, PROVISION_AP_SSID, WiFi.softAPIP().toString().c_str());
+}
+
+// Stores the credentials and lets wifiPoll() scan for them right away
+bool provisionNetwork(const String &ssid, const String &pass) {
+  if (!wifiAddNetwork(ssid, pass)) return false;
+  wifiState.scans = 0;
+  wifiSetPhase(WIFI_IDLE, monoUs());
+  provision.failed = false;
+  provisionSetState(PROV_JOINING);
+  return true;
+}
+
+void provisionPoll(uint64_t now) {
+  bool connected = WiFi.isConnected();
+  if (provision.state == PROV_OFF) {
+    if (!connected && wifiState.downSinceUs && now - wifiState.downSinceUs >= PROVISION_FALLBACK_US) {
+      provisionBegin("No link with the known WiFi networks");
+    }
+    return;
+  }
+  dns.processNextRequest();
+  if (provision.state != PROV_DONE && connected) {
+    provisionSetState(PROV_DONE);
+    LOG(LOG_INFO, "Provisioned: joined %s as %s", WiFi.SSID().c_str(), WiFi.localIP().toString().c_str());
+  } else if (provision.state == PROV_JOINING && now - provision.sinceUs >= PROVISION_JOIN_US) {
+    // wifiPoll() keeps retrying the stored network in the background
+    provision.failed = true;
+    provisionSetState(PROV_WAITING);
+    LOG(LOG_WARN, "Provisioning: no link to the new network yet");
+  } else if (provision.state == PROV_DONE && now - provision.sinceUs >= PROVISION_LINGER_US) {
+    dns.stop();
+    WiFi.softAPdisconnect(true);
+    WiFi.mode(WIFI_STA);
+    provisionSetState(PROV_OFF);
+  }
+}
+
+String provisionJson() {
+  JsonDocument doc;
+  doc["state"] = provisionStateNames[provision.state];
+  doc["failed"] = provision.failed;
+  doc["chipId"] = ESP.getChipId();
+  doc["mac"] = WiFi.macAddress();
+  JsonArray known = doc["networks"].to<JsonArray>();
+  for (uint8_t i = 0; i < wifiNetworkCount; i++) known.add(wifiNetworks[i].ssid);
+  if (WiFi.isConnected()) {
+    doc["ssid"] = WiFi.SSID();
+    doc["ip"] = WiFi.localIP().toString();
+  }
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+// Big-endian field helpers for the DNS and NTP wire formats
+void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+// Small DNS cache in front of every outbound hostname. Lookups are sent
+// to the DHCP-provided resolver from loop() and never block; entries keep
+// the record's TTL and are served stale for up to DNSC_STALE_US past expiry
+// while a refresh runs, so a briefly unreachable resolver goes unnoticed.
+#define DNSC_PORT         53
+#define DNSC_LOCAL_PORT   5354
+#define DNSC_CACHE_SIZE   4
+#define DNSC_TIMEOUT_US   MS_US(2000)
+#define DNSC_MAX_RETRIES  2
+#define DNSC_MIN_TTL_S    30
+#define DNSC_MAX_TTL_S    86400UL
+#define DNSC_STALE_US     SEC_US(86400)
+
+enum DnsResult { DNSC_OK, DNSC_PENDING, DNSC_FAILED };
+
+struct DnsEntry {
+  char host[64] = "";
+  IPAddress ip;
+  bool valid = false;            // ip holds a resolved address (possibly stale)
+  bool failed = false;           // last lookup failed and nothing is cached
+  uint64_t fetchedUs = 0;
+  uint64_t ttlUs = 0;
+  uint64_t lastUsedUs = 0;
+  bool pending = false;
+  uint16_t queryId = 0;
+  uint8_t attempts = 0;
+  uint64_t sentUs = 0;
+};
+
+struct DnsStats {
+  uint32_t hits = 0;
+  uint32_t staleHits = 0;
+  uint32_t misses = 0;
+  uint32_t failures = 0;
+  uint32_t resolves = 0;
+  uint32_t lastLatencyUs = 0;
+  uint32_t maxLatencyUs = 0;
+  uint64_t totalLatencyUs = 0;
+};
+
+WiFiUDP dnsUdp;
+DnsEntry dnsCache[DNSC_CACHE_SIZE];
+DnsStats dnsStats;
+
+void dnsSendQuery(DnsEntry &e) {
+  uint8_t pkt[12 + sizeof(e.host) + 6] = {0};
+  e.queryId = random(1, 65536);
+  pkt[0] = e.queryId >> 8;
+  pkt[1] = e.queryId;
+  pkt[2] = 0x01;                 // RD
+  pkt[5] = 1;                    // QDCOUNT
+  size_t pos = 12;
+  const char *label = e.host;
+  while (*label) {
+    const char *dot = strchr(label, '.');
+    size_t len = dot ? (size_t)(dot - label) : strlen(label);
+    if (len == 0 || len > 63) break;
+    pkt[pos++] = len;
+    memcpy(pkt + pos, label, len);
+    pos += len;
+    label += len + (dot ? 1 : 0);
+  }
+  pkt[pos++] = 0;
+  pkt[pos++] = 0; pkt[pos++] = 1;   // QTYPE A
+  pkt[pos++] = 0; pkt[pos++] = 1;   // QCLASS IN
+  dnsUdp.beginPacket(WiFi.dnsIP(0), DNSC_PORT);
+  dnsUdp.write(pkt, pos);
+  dnsUdp.endPacket();
+  e.pending = true;
+  e.attempts++;
+  e.sentUs = monoUs();
+}
+
+// Skips a possibly compressed name, returns the offset after it or 0.
+size_t dnsSkipName(const uint8_t *pkt, size_t len, size_t pos) {
+  while (pos < len) {
+    uint8_t l = pkt[pos];
+    if ((l & 0xC0) == 0xC0) return pos + 2;
+    if (l == 0) return pos + 1;
+    pos += l + 1;
+  }
+  return 0;
+}
+
+void dnsHandleResponse(const uint8_t *pkt, size_t len) {
+  if (len < 12 || !(pkt[2] & 0x80)) return;
+  uint16_t id = pkt[0] << 8 | pkt[1];
+  DnsEntry *e = nullptr;
+  for (auto &c : dnsCache) {
+    if (c.pending && c.queryId == id) e = &c;
+  }
+  if (!e) return;
+  e->pending = false;
+  uint32_t latency = monoUs() - e->sentUs;
+  dnsStats.resolves++;
+  dnsStats.lastLatencyUs = latency;
+  dnsStats.totalLatencyUs += latency;
+  if (latency > dnsStats.maxLatencyUs) dnsStats.maxLatencyUs = latency;
+
+  uint16_t qd = pkt[4] << 8 | pkt[5];
+  uint16_t an = pkt[6] << 8 | pkt[7];
+  size_t pos = 12;
+  for (uint16_t i = 0; i < qd && pos; i++) {
+    pos = dnsSkipName(pkt, len, pos);
+    if (pos) pos += 4;
+  }
+  uint32_t ttl = DNSC_MAX_TTL_S;
+  for (uint16_t i = 0; i < an && pos && pos + 10 <= len; i++) {
+    pos = dnsSkipName(pkt, len, pos);
+    if (!pos || pos + 10 > len) break;
+    uint16_t type = pkt[pos] << 8 | pkt[pos + 1];
+    uint32_t rrTtl = get32(pkt + pos + 4);
+    uint16_t rdlen = pkt[pos + 8] << 8 | pkt[pos + 9];
+    pos += 10;
+    if (pos + rdlen > len) break;
+    if (rrTtl < ttl) ttl = rrTtl;   // a CNAME chain is only as fresh as its shortest link
+    if (type == 1 && rdlen == 4) {
+      e->ip = IPAddress(pkt[pos], pkt[pos + 1], pkt[pos + 2], pkt[pos + 3]);
+      e->valid = true;
+      e->failed = false;
+      e->fetchedUs = monoUs();
+      e->ttlUs = SEC_US(constrain(ttl, (uint32_t)DNSC_MIN_TTL_S, DNSC_MAX_TTL_S));
+      return;
+    }
+    pos += rdlen;
+  }
+  dnsStats.failures++;
+  if (!e->valid) e->failed = true;
+}
+
+void dnsPoll(uint64_t now) {
+  int size = dnsUdp.parsePacket();
+  if (size > 0) {
+    uint8_t pkt[512];
+    int len = dnsUdp.read(pkt, sizeof(pkt));
+    if (len > 0) dnsHandleResponse(pkt, len);
+  }
+  for (auto &e : dnsCache) {
+    if (!e.pending || now - e.sentUs < DNSC_TIMEOUT_US) continue;
+    if (e.attempts < DNSC_MAX_RETRIES) {
+      dnsSendQuery(e);
+    } else {
+      e.pending = false;
+      dnsStats.failures++;
+      if (!e.valid) e.failed = true;
+    }
+  }
+}
+
+// Non-blocking resolve. DNSC_PENDING means a query is in flight; call again
+// from a later loop() pass. Literal addresses are returned without caching.
+DnsResult dnsLookup(const char *host, IPAddress &ip) {
+  if (!*host) return DNSC_FAILED;
+  if (ip.fromString(host)) return DNSC_OK;
+  uint64_t now = monoUs();
+  DnsEntry *e = nullptr;
+  for (auto &c : dnsCache) {
+    if (strcmp(c.host, host) == 0) e = &c;
+  }
+  if (!e) {
+    e = &dnsCache[0];
+    for (auto &c : dnsCache) {
+      if (c.lastUsedUs < e->lastUsedUs) e = &c;
+    }
+    *e = DnsEntry();
+    strlcpy(e->host, host, sizeof(e->host));
+  }
+  e->lastUsedUs = now;
+
+  if (e->valid) {
+    uint64_t age = now - e->fetchedUs;
+    if (age < e->ttlUs) {
+      dnsStats.hits++;
+      ip = e->ip;
+      return DNSC_OK;
+    }
+    if (age < e->ttlUs + DNSC_STALE_US) {
+      dnsStats.staleHits++;
+      if (!e->pending) {
+        e->attempts = 0;
+        dnsSendQuery(*e);
+      }
+      ip = e->ip;
+      return DNSC_OK;
+    }
+    e->valid = false;
+  }
+  if (e->failed) {
+    e->failed = false;   // report once, the next call starts a fresh lookup
+    return DNSC_FAILED;
+  }
+  if (!e->pending) {
+    dnsStats.misses++;
+    e->attempts = 0;
+    dnsSendQuery(*e);
+  }
+  return DNSC_PENDING;
+}
+
+// Sends up to SYSLOG_SEND_MAX records per pass, one per datagram without
+// the ring's newline separator
+void syslogPoll() {
+  static IPAddress collector;
+  if (!config.syslogHost.length() || syslogUsed() == 0 || !WiFi.isConnected()) return;
+  if (dnsLookup(config.syslogHost.c_str(), collector) != DNSC_OK) return;
+  for (int n = 0; n < SYSLOG_SEND_MAX && syslogUsed(); n++) {
+    size_t used = syslogUsed();
+    size_t size = 0;
+    while (size < used && syslogRing[(syslogTail + size) % SYSLOG_RING_SIZE] != '\n') size++;
+    if (size == used) {   // cannot happen for records from syslogEnqueue, but never wedge
+      syslogTail = syslogHead;
+      return;
+    }
+    size_t first = min(size, SYSLOG_RING_SIZE - syslogTail);
+    syslogUdp.beginPacket(collector, config.syslogPort);
+    syslogUdp.write((const uint8_t *)syslogRing + syslogTail, first);
+    if (first < size) syslogUdp.write((const uint8_t *)syslogRing, size - first);
+    syslogUdp.endPacket();
+    syslogTail = (syslogTail + size + 1) % SYSLOG_RING_SIZE;
+    syslogStats.datagrams++;
+  }
+}
+
+// SNTP client (and optional server) on one UDP socket bound to port 123.
+// Running our own client instead of configTime() gives us the upstream
+// stratum, reference and dispersion, which the server mode passes on.
+#define NTP_PORT            123
+#define NTP_PACKET_SIZE     48
+#define NTP_UNIX_OFFSET     2208988800UL   // seconds from 1900 to 1970
+#define NTP_TIMEOUT_US      MS_US(2000)
+#define NTP_MAX_RETRIES     3
+#define NTP_MAX_DELAY_US    1000000
+#define NTP_PRECISION       -10            // ~1 ms, bounded by loop latency
+#define NTP_SERVE_MAX_AGE_US SEC_US(24UL * 3600)
+
+WiFiUDP ntpUdp;
+
+enum TimeSourceKind : uint8_t { TIME_SRC_NONE, TIME_SRC_NTP, TIME_SRC_HTTP };
+
+struct TimeState {
+  bool synced = false;
+  TimeSourceKind source = TIME_SRC_NONE;
+  uint8_t leap = 0;              // leap indicator of the last upstream reply
+  uint8_t stratum = 0;           // upstream stratum
+  IPAddress refIp;               // upstream server, our reference ID
+  uint32_t rootDelay = 0;        // NTP short format (16.16 s), includes our round trip
+  uint32_t rootDispersion = 0;   // NTP short format, at the time of the last sync
+  struct timeval refTime = {0, 0};
+  uint64_t lastSyncUs = 0;
+  int32_t lastOffsetUs = 0;
+  uint32_t lastDelayUs = 0;
+  uint32_t syncs = 0;
+  uint32_t failures = 0;
+  uint32_t served = 0;
+};
+
+TimeState timeState;
+
+struct NtpQuery {
+  bool resolving = false;
+  bool active = false;
+  uint8_t attempts = 0;
+  uint64_t sentUs = 0;
+  IPAddress server;
+  uint8_t xmt[8];                // our transmit timestamp, echoed back as originate
+};
+
+NtpQuery ntpQuery;
+
+int64_t ntpToMicros(const uint8_t *p) {
+  uint32_t sec = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+  uint32_t frac = (uint32_t)p[4] << 24 | (uint32_t)p[5] << 16 | (uint32_t)p[6] << 8 | p[7];
+  return (int64_t)sec * 1000000 + (((uint64_t)frac * 1000000) >> 32);
+}
+
+void putNtpTimestamp(uint8_t *p, const struct timeval &tv) {
+  uint32_t sec = tv.tv_sec + NTP_UNIX_OFFSET;
+  uint32_t frac = ((uint64_t)tv.tv_usec << 32) / 1000000;
+  for (int i = 0; i < 4; i++) {
+    p[i] = sec >> (24 - 8 * i);
+    p[4 + i] = frac >> (24 - 8 * i);
+  }
+}
+
+int64_t timevalToNtpMicros(const struct timeval &tv) {
+  return ((int64_t)tv.tv_sec + NTP_UNIX_OFFSET) * 1000000 + tv.tv_usec;
+}
+
+uint32_t microsToNtpShort(uint32_t us) {
+  return ((uint64_t)us << 16) / 1000000;
+}
+
+void ntpSend() {
+  uint8_t pkt[NTP_PACKET_SIZE] = {0};
+  pkt[0] = (4 << 3) | 3;          // LI 0, version 4, mode 3 (client)
+  struct timeval now;
+  gettimeofday(&now, nullptr);
+  putNtpTimestamp(ntpQuery.xmt, now);
+  memcpy(pkt + 40, ntpQuery.xmt, 8);
+  ntpUdp.beginPacket(ntpQuery.server, NTP_PORT);
+  ntpUdp.write(pkt, sizeof(pkt));
+  ntpUdp.endPacket();
+  ntpQuery.sentUs = monoUs();
+  ntpQuery.attempts++;
+}
+
+void ntpRequest() {
+  if (!WiFi.isConnected()) return;
+  ntpQuery.resolving = true;
+  ntpQuery.active = false;
+}
+
+void applyTimeOffset(int64_t offsetUs) {
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  int64_t us = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec + offsetUs;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+  settimeofday(&tv, nullptr);
+}
+
+// Offset and drift estimator shared by every time source. A sample steps
+// the clock by its offset; samples precise enough (NTP, not the 1 s HTTP
+// Date) also refine the drift rate, which timeDriftTick() then applies
+// between syncs so the clock keeps time without waiting for the next one.
+#define DRIFT_MIN_INTERVAL_US   SEC_US(5 * 60)
+#define DRIFT_MAX_SAMPLE_ERR_US 20000
+#define DRIFT_MAX_PPB           500000
+#define DRIFT_APPLY_NS          1000000
+
+struct DriftEstimator {
+  int32_t ppb = 0;               // rate added to the clock, positive = crystal runs slow
+  uint32_t samples = 0;          // samples that refined ppb
+  bool haveRef = false;
+  uint64_t refUs = 0;            // time of the last drift-quality sample
+  uint64_t lastTickUs = 0;
+  int64_t pendingNs = 0;         // accrued correction not yet applied
+};
+
+DriftEstimator drift;
+
+// Drift history: every sync appends a record to one of two LittleFS
+// segments, /drift.0 and /drift.1, the same way the event log does. When
+// the active segment is full the other one is emptied and takes over, so
+// records are only ever appended and the history is bounded at
+// 2 x DRIFT_SEGMENT_RECORDS. At boot the recent rates seed the estimator,
+// and a run of small offsets lets the sync interval back off (see syncBackoff).
+#define DRIFT_SEGMENT_RECORDS 256
+#define DRIFT_LOG_SEED_COUNT  8
+#define DRIFT_TOLERANCE_US    50000
+#define DRIFT_LOG_LEGACY_PATH "/drift.bin"   // single-file ring of older firmware
+#define SYNC_BACKOFF_MAX      8
+
+struct DriftRecord {
+  uint32_t seq;
+  uint32_t unixTime;
+  int32_t offsetUs;        // correction applied by this sync
+  uint32_t delayUs;        // round trip of the sample
+  int32_t driftPpb;        // estimator rate after this sync
+  uint8_t source;          // TimeSourceKind
+  uint8_t reserved[3];
+};
+
+uint32_t driftLogSeq = 0;              // sequence number of the newest record
+uint8_t driftSegment = 0;              // segment receiving appends
+uint32_t driftSegmentFirst[2] = {};    // first sequence number per segment, 0 if empty
+uint16_t driftSegmentCount[2] = {};
+uint8_t syncBackoff = 1;               // multiplier on config.ntpSyncInterval
+
+const char *driftPath(uint8_t segment) {
+  return segment ? "/drift.1" : "/drift.0";
+}
+
+// Appends r under the next sequence number
+void driftLogWrite(DriftRecord r) {
+  r.seq = driftLogSeq + 1;
+  if (driftSegmentCount[driftSegment] >= DRIFT_SEGMENT_RECORDS) {
+    driftSegment ^= 1;
+    LittleFS.remove(driftPath(driftSegment));
+    driftSegmentFirst[driftSegment] = 0;
+    driftSegmentCount[driftSegment] = 0;
+  }
+  File f = LittleFS.open(driftPath(driftSegment), "a");
+  if (!f) return;
+  f.write((const uint8_t *)&r, sizeof(r));
+  f.close();
+  driftLogSeq = r.seq;
+  if (!driftSegmentCount[driftSegment]) driftSegmentFirst[driftSegment] = r.seq;
+  driftSegmentCount[driftSegment]++;
+}
+
+void driftLogAppend(int64_t offsetUs, uint32_t delayUs, TimeSourceKind source) {
+  DriftRecord r = {};
+  r.unixTime = time(nullptr);
+  r.offsetUs = constrain(offsetUs, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+  r.delayUs = delayUs;
+  r.driftPpb = drift.ppb;
+  r.source = source;
+  driftLogWrite(r);
+}
+
+bool driftLogRead(uint32_t seq, DriftRecord &r) {
+  for (uint8_t seg = 0; seg < 2; seg++) {
+    uint32_t first = driftSegmentFirst[seg];
+    if (!driftSegmentCount[seg] || seq < first || seq >= first + driftSegmentCount[seg]) continue;
+    File f = LittleFS.open(driftPath(seg), "r");
+    if (!f) return false;
+    f.seek((seq - first) * sizeof(DriftRecord));
+    bool ok = f.read((uint8_t *)&r, sizeof(r)) == sizeof(r) && r.seq == seq;
+    f.close();
+    return ok;
+  }
+  return false;
+}
+
+// Recovers the segment layout and seeds the drift rate from the last NTP syncs
+void driftLogLoad() {
+  if (LittleFS.exists(DRIFT_LOG_LEGACY_PATH)) LittleFS.remove(DRIFT_LOG_LEGACY_PATH);
+  driftLogSeq = 0;
+  for (uint8_t seg = 0; seg < 2; seg++) {
+    driftSegmentFirst[seg] = 0;
+    driftSegmentCount[seg] = 0;
+    File f = LittleFS.open(driftPath(seg), "r");
+    if (!f) continue;
+    DriftRecord r;
+    uint16_t count = min(f.size() / sizeof(DriftRecord), (size_t)DRIFT_SEGMENT_RECORDS);
+    if (count && f.read((uint8_t *)&r, sizeof(r)) == sizeof(r)) {
+      driftSegmentFirst[seg] = r.seq;
+      driftSegmentCount[seg] = count;
+      driftLogSeq = max(driftLogSeq, r.seq + count - 1);
+    }
+    f.close();
+  }
+  driftSegment = driftSegmentFirst[1] > driftSegmentFirst[0] ? 1 : 0;
+
+  int64_t sum = 0;
+  int n = 0;
+  DriftRecord r;
+  for (uint32_t seq = driftLogSeq; seq > 0 && n < DRIFT_LOG_SEED_COUNT && driftLogRead(seq, r); seq--) {
+    if (r.source != TIME_SRC_NTP) continue;
+    sum += r.driftPpb;
+    n++;
+  }
+  if (n) {
+    drift.ppb = sum / n;
+    LOG(LOG_INFO, "Drift seeded from %d records: %ld ppb", n, (long)drift.ppb);
+  }
+}
+
+// Stretches the sync interval while syncs keep landing well inside the
+// tolerance and snaps back as soon as one does not.
+void updateSyncBackoff(int64_t offsetUs) {
+  if (llabs(offsetUs) > DRIFT_TOLERANCE_US / 2) {
+    syncBackoff = 1;
+  } else if (llabs(offsetUs) < DRIFT_TOLERANCE_US / 4 && drift.samples >= 3 && syncBackoff < SYNC_BACKOFF_MAX) {
+    syncBackoff *= 2;
+  }
+}
+
+void timeSample(int64_t offsetUs, uint32_t delayUs, uint32_t errorUs, TimeSourceKind source) {
+  uint64_t now = monoUs();
+  bool precise = errorUs <= DRIFT_MAX_SAMPLE_ERR_US;
+  // A coarse sample only corrects us when we are off by more than its own error
+  if (timeState.synced && !precise && llabs(offsetUs) <= errorUs) return;
+
+  if (precise && drift.haveRef && now - drift.refUs >= DRIFT_MIN_INTERVAL_US && llabs(offsetUs) < 1000000) {
+    int64_t residualPpb = offsetUs * 1000000000 / (int64_t)(now - drift.refUs);
+    drift.ppb = constrain(drift.ppb + residualPpb / 2, (int64_t)-DRIFT_MAX_PPB, (int64_t)DRIFT_MAX_PPB);
+    drift.samples++;
+  }
+  drift.haveRef = precise;
+  drift.refUs = now;
+  drift.pendingNs = 0;
+
+  bool wasSynced = timeState.synced;
+  applyTimeOffset(offsetUs);
+  if (!wasSynced) bootProfileMark(BOOT_VALID_TIME);
+  if (wasSynced) {   // the first sample only sets the clock
+    driftLogAppend(offsetUs, delayUs, source);
+    if (precise) updateSyncBackoff(offsetUs);
+  }
+  timeState.synced = true;
+  timeState.source = source;
+  gettimeofday(&timeState.refTime, nullptr);
+  timeState.lastSyncUs = now;
+  timeState.lastOffsetUs = constrain(offsetUs, (int64_t)INT32_MIN, (int64_t)INT32_MAX);
+  timeState.lastDelayUs = delayUs;
+  timeState.syncs++;
+  busPublish(BUS_TIME_SYNCED, timeState.lastOffsetUs, source);
+}
+
+void timeDriftTick(uint64_t now) {
+  uint64_t elapsed = now - drift.lastTickUs;
+  if (elapsed < SEC_US(1)) return;
+  drift.lastTickUs = now;
+  if (!timeState.synced || drift.ppb == 0) return;
+  drift.pendingNs += (int64_t)drift.ppb * (int64_t)elapsed / 1000000;
+  if (llabs(drift.pendingNs) >= DRIFT_APPLY_NS) {
+    int64_t us = drift.pendingNs / 1000;
+    applyTimeOffset(us);
+    drift.pendingNs -= us * 1000;
+  }
+}
+
+// Leap seconds. NTP announces them with the leap indicator during the month
+// that ends with one. Rather than stepping at midnight, the correction is
+// smeared linearly over config.leapSmearHours centred on the leap, like the
+// public smearing servers, so the clock (and what we serve) stays continuous.
+// leap.appliedUs is the part of the smear already in the system clock;
+// once the window has passed the clock is plain POSIX time again.
+struct LeapState {
+  int8_t pending = 0;      // +1 inserted second, -1 deleted second
+  time_t at = 0;           // UTC midnight ending the leap day
+  int64_t appliedUs = 0;
+};
+
+LeapState leap;
+
+uint32_t leapWindowS() {
+  return (uint32_t)config.leapSmearHours * 3600;
+}
+
+bool leapWindowOver(int64_t tauUs) {
+  return tauUs >= (int64_t)leap.at * 1000000 + (int64_t)leapWindowS() * 500000;
+}
+
+// Called with each upstream reply's leap indicator and server time
+void leapAnnounce(uint8_t li, time_t serverTime) {
+  if (li == 1 || li == 2) {
+    struct tm t;
+    gmtime_r(&serverTime, &t);
+    int y = t.tm_year + 1900;
+    unsigned m = t.tm_mon + 2;
+    if (m > 12) { m = 1; y++; }
+    time_t at = daysFromCivil(y, m, 1) * 86400;
+    if (leap.pending == 0) LOG(LOG_WARN, "Leap second (%s) announced for %ld", li == 1 ? "+1" : "-1", (long)at);
+    leap.pending = li == 1 ? 1 : -1;
+    leap.at = at;
+  } else if (leap.pending && leap.appliedUs == 0) {
+    leap.pending = 0;   // withdrawn before the smear started
+  }
+}
+
+// Where the smear of the announced leap puts an upstream time
+int64_t leapTargetUs(int64_t posixUs) {
+  return leapTargetUs(posixUs, leap.at, leap.pending, leapWindowS());
+}
+
+void leapTick() {
+  if (!leap.pending || !timeState.synced) return;
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  int64_t tau = (int64_t)tv.tv_sec * 1000000 + tv.tv_usec - leap.appliedUs;
+  int64_t target = leapSmearUs(tau, leap.at, leap.pending, leapWindowS());
+  if (llabs(target - leap.appliedUs) >= 1000 || (target != leap.appliedUs && leapWindowOver(tau))) {
+    applyTimeOffset(target - leap.appliedUs);
+    leap.appliedUs = target;
+  }
+  if (leapWindowOver(tau) && leap.appliedUs == target) {
+    LOG(LOG_WARN, "Leap second applied");
+    leap.pending = 0;
+    leap.appliedUs = 0;
+  }
+}
+
+void ntpHandleReply(const uint8_t *pkt, const struct timeval &rx) {
+  if (!ntpQuery.active || memcmp(pkt + 24, ntpQuery.xmt, 8) != 0) return;   // stale or spoofed
+  uint8_t stratum = pkt[1];
+  if (stratum == 0 || stratum > 15 || (pkt[0] >> 6) == 3) {
+    LOG(LOG_WARN, "NTP: server unsynchronized (stratum %u)", stratum);
+    return;
+  }
+  int64_t t1 = ntpToMicros(pkt + 24);
+  int64_t t2 = ntpToMicros(pkt + 32);
+  int64_t t3 = ntpToMicros(pkt + 40);
+  int64_t t4 = timevalToNtpMicros(rx);
+  int64_t delay = (t4 - t1) - (t3 - t2);
+  if (delay < 0 || delay > NTP_MAX_DELAY_US) return;   // let the timeout retry
+  int64_t offset = ((t2 - t1) + (t3 - t4)) / 2;
+  ntpQuery.active = false;
+
+  // Upstream time is unsmeared POSIX; aim for where our smear should be
+  int64_t serverUs = t3 - (int64_t)NTP_UNIX_OFFSET * 1000000;
+  leapAnnounce(pkt[0] >> 6, serverUs / 1000000);
+  offset += leapTargetUs(serverUs) - serverUs;
+
+  timeSample(offset, delay, delay / 2 + 1000, TIME_SRC_NTP);
+  timeState.leap = pkt[0] >> 6;
+  timeState.stratum = stratum;
+  timeState.refIp = ntpQuery.server;
+  timeState.rootDelay = get32(pkt + 4) + microsToNtpShort(delay);
+  timeState.rootDispersion = get32(pkt + 8) + microsToNtpShort(delay / 2) + microsToNtpShort(1000);
+  LOG(LOG_INFO, "NTP: offset %.3f ms, delay %u us, stratum %u", offset / 1000.0, (uint32_t)delay, stratum);
+}
+
+#if FEATURE_NTP_SERVER
+// Answers a client request with our clock, one stratum below our upstream.
+// Dispersion grows by 15 PPM (RFC 5905 PHI) for every second since the sync.
+void ntpServe(const uint8_t *req, const struct timeval &rx) {
+  uint64_t age = monoUs() - timeState.lastSyncUs;
+  if (!config.ntpServerMode || !timeState.synced || age > NTP_SERVE_MAX_AGE_US) return;
+  uint8_t version = (req[0] >> 3) & 7;
+  uint8_t resp[NTP_PACKET_SIZE] = {0};
+  // While smearing we serve smeared time, which like other smearing servers carries no leap warning
+  uint8_t li = config.leapSmearHours ? 0 : timeState.leap;
+  resp[0] = (li << 6) | ((version ? version : 4) << 3) | 4;   // mode 4 (server)
+  resp[1] = timeState.stratum < 15 ? timeState.stratum + 1 : 15;
+  resp[2] = req[2];
+  resp[3] = (uint8_t)NTP_PRECISION;
+  put32(resp + 4, timeState.rootDelay);
+  put32(resp + 8, timeState.rootDispersion + (uint32_t)((age * 65536 * 15) / 1000000000000ULL));
+  for (int i = 0; i < 4; i++) resp[12 + i] = timeState.refIp[i];
+  putNtpTimestamp(resp + 16, timeState.refTime);
+  memcpy(resp + 24, req + 40, 8);
+  putNtpTimestamp(resp + 32, rx);
+  struct timeval tx;
+  gettimeofday(&tx, nullptr);
+  putNtpTimestamp(resp + 40, tx);
+  ntpUdp.beginPacket(ntpUdp.remoteIP(), ntpUdp.remotePort());
+  ntpUdp.write(resp, sizeof(resp));
+  ntpUdp.endPacket();
+  timeState.served++;
+}
+#endif
+
+// Fallback time source for sites that block UDP/123: a HEAD request to
+// config.timeFallbackUrl and its Date header. The server stamped the reply
+// somewhere within that second and within the round trip, so the estimate
+// is Date + 0.5 s at the local midpoint, with an error of 0.5 s + RTT/2.
+#define HTTP_TIME_TIMEOUT_US MS_US(5000)
+#define HTTP_TIME_MAX_HEADER 1024
+
+struct HttpTimeQuery {
+  bool resolving = false;
+  AsyncClient *client = nullptr;
+  String host;
+  uint16_t port = 80;
+  String path;
+  IPAddress ip;
+  uint64_t startUs = 0;
+  struct timeval sentAt;
+  uint64_t sentUs = 0;
+  uint32_t rttUs = 0;
+  String header;
+  bool resultReady = false;
+  time_t date = 0;
+};
+
+HttpTimeQuery httpTime;
+
+bool parseHttpUrl(const String &url, String &host, uint16_t &port, String &path) {
+  String rest = url.startsWith("http://") ? url.substring(7) : url;
+  int slash = rest.indexOf('/');
+  path = slash >= 0 ? rest.substring(slash) : "/";
+  String hostPort = slash >= 0 ? rest.substring(0, slash) : rest;
+  int colon = hostPort.indexOf(':');
+  host = colon >= 0 ? hostPort.substring(0, colon) : hostPort;
+  port = colon >= 0 ? hostPort.substring(colon + 1).toInt() : 80;
+  return host.length() > 0 && port > 0;
+}
+
+void httpTimeRequest() {
+  if (httpTime.resolving || httpTime.client || config.timeFallbackUrl.length() == 0) return;
+  if (!parseHttpUrl(config.timeFallbackUrl, httpTime.host, httpTime.port, httpTime.path)) {
+    LOG(LOG_ERROR, "HTTP time: bad URL %s", config.timeFallbackUrl.c_str());
+    return;
+  }
+  httpTime.resolving = true;
+}
+
+void httpTimeConnect() {
+  AsyncClient *c = new AsyncClient();
+  httpTime.client = c;
+  httpTime.startUs = monoUs();
+  httpTime.header = "";
+  httpTime.rttUs = 0;
+  c->onConnect([](void *, AsyncClient *c) {
+    String req = "HEAD " + httpTime.path + " HTTP/1.1\r\nHost: " + httpTime.host + "\r\nConnection: close\r\n\r\n";
+    gettimeofday(&httpTime.sentAt, nullptr);
+    httpTime.sentUs = monoUs();
+    c->write(req.c_str(), req.length());
+  });
+  c->onData([](void *, AsyncClient *c, void *data, size_t len) {
+    if (!httpTime.rttUs) httpTime.rttUs = monoUs() - httpTime.sentUs;
+    if (httpTime.header.length() + len > HTTP_TIME_MAX_HEADER) len = HTTP_TIME_MAX_HEADER - httpTime.header.length();
+    httpTime.header.concat((const char *)data, len);
+    int end = httpTime.header.indexOf("\r\n\r\n");
+    if (end < 0 && httpTime.header.length() < HTTP_TIME_MAX_HEADER) return;
+    int date = httpTime.header.indexOf("\r\nDate: ");
+    if (date < 0) date = httpTime.header.indexOf("\r\ndate: ");
+    if (date < 0) LOG(LOG_WARN, "HTTP time: no Date header from %s", httpTime.host.c_str());
+    else if (parseHttpDate(httpTime.header.c_str() + date + 8, httpTime.date)) httpTime.resultReady = true;
+    else LOG(LOG_WARN, "HTTP time: unparseable Date header from %s", httpTime.host.c_str());
+    c->close();
+  });
+  c->onDisconnect([](void *, AsyncClient *c) {
+    httpTime.client = nullptr;
+    delete c;
+  });
+  if (!c->connect(httpTime.ip, httpTime.port)) {
+    httpTime.client = nullptr;
+    delete c;
+    LOG(LOG_WARN, "HTTP time: connect failed");
+  }
+}
+
+void httpTimePoll(uint64_t now) {
+  if (httpTime.resolving) {
+    DnsResult r = dnsLookup(httpTime.host.c_str(), httpTime.ip);
+    if (r != DNSC_PENDING) httpTime.resolving = false;
+    if (r == DNSC_OK) httpTimeConnect();
+  }
+  if (httpTime.client && now - httpTime.startUs > HTTP_TIME_TIMEOUT_US) {
+    LOG(LOG_WARN, "HTTP time: no reply from %s within %u ms", httpTime.host.c_str(), (unsigned)(HTTP_TIME_TIMEOUT_US / 1000));
+    httpTime.client->close(true);
+  }
+  if (httpTime.resultReady) {
+    httpTime.resultReady = false;
+    int64_t midUs = (int64_t)httpTime.sentAt.tv_sec * 1000000 + httpTime.sentAt.tv_usec + httpTime.rttUs / 2;
+    int64_t offset = (int64_t)httpTime.date * 1000000 + 500000 - midUs;
+    uint32_t error = 500000 + httpTime.rttUs / 2;
+    timeSample(offset, httpTime.rttUs, error, TIME_SRC_HTTP);
+    if (timeState.source == TIME_SRC_HTTP) {
+      // Good to ±0.5 s at best, whatever NTP stratum the clock had before,
+      // so the server mode advertises it at the lowest valid stratum
+      timeState.stratum = 15;
+      timeState.refIp = httpTime.ip;
+      timeState.rootDelay = microsToNtpShort(httpTime.rttUs);
+      timeState.rootDispersion = microsToNtpShort(error);
+    }
+    LOG(LOG_INFO, "HTTP time: offset %.3f ms, rtt %u us", offset / 1000.0, httpTime.rttUs);
+  }
+}
+
+void ntpPoll(uint64_t now) {
+  if (ntpQuery.resolving) {
+    DnsResult r = dnsLookup(config.ntpServer.c_str(), ntpQuery.server);
+    if (r == DNSC_OK) {
+      ntpQuery.resolving = false;
+      ntpQuery.active = true;
+      ntpQuery.attempts = 0;
+      ntpSend();
+    } else if (r == DNSC_FAILED) {
+      ntpQuery.resolving = false;
+      timeState.failures++;
+      eventLog(EV_SYNC_FAIL, 0);
+      LOG(LOG_WARN, "NTP: cannot resolve %s", config.ntpServer.c_str());
+      httpTimeRequest();
+    }
+  }
+
+  int size = ntpUdp.parsePacket();
+  if (size >= NTP_PACKET_SIZE) {
+    struct timeval rx;
+    gettimeofday(&rx, nullptr);
+    uint8_t pkt[NTP_PACKET_SIZE];
+    ntpUdp.read(pkt, sizeof(pkt));
+    uint8_t mode = pkt[0] & 7;
+    if (mode == 4) ntpHandleReply(pkt, rx);
+#if FEATURE_NTP_SERVER
+    else if (mode == 3) ntpServe(pkt, rx);
+#endif
+  } else if (size > 0) {
+    ntpUdp.flush();
+  }
+
+  if (ntpQuery.active && now - ntpQuery.sentUs >= NTP_TIMEOUT_US) {
+    if (ntpQuery.attempts < NTP_MAX_RETRIES) {
+      ntpSend();
+    } else {
+      ntpQuery.active = false;
+      timeState.failures++;
+      eventLog(EV_SYNC_FAIL, 1);
+      LOG(LOG_WARN, "NTP: no reply from %s", config.ntpServer.c_str());
+      httpTimeRequest();
+    }
+  }
+}
+
+void setupTime() {
+  setenv("TZ", config.timezone.c_str(), 1);
+  tzset();
+  ntpRequest();
+}
+
+const uint8_t hourSegmentOrder[7] = {1, 0, 4, 5, 6, 2, 3};
+const uint8_t minuteSegmentOrder[7] = {5, 4, 6, 3, 0, 2, 1};
+
+// Hot frame path: digits are rendered into a small frame buffer, composed
+// with the dots and written straight into the NeoPixel GRB buffers. Digit
+// rendering, compositing and the output driver's per-pixel calibration loop
+// are kept in IRAM; the strips' show() is flash-resident in the NeoPixel
+// library and the effect interpreter is too large to spend IRAM on without
+// numbers from /api/bench. Build with -D RENDER_IN_IRAM=0 to get a
+// flash-resident comparison image; scripts/size_report.py lists what each
+// image puts in IRAM.
+#ifndef RENDER_IN_IRAM
+#define RENDER_IN_IRAM 1
+#endif
+#if RENDER_IN_IRAM
+#define HOT_PATH IRAM_ATTR
+#else
+#define HOT_PATH
+#endif
+
+static_assert(NUM_LEDS == EFFECT_STRIP_LEDS, "effectvm.h addresses the strips by EFFECT_STRIP_LEDS");
+
+// The strip layout (HOUR_STRIP, MINUTE_STRIP, digitStripIndex and
+// digitStartIndex) lives in effectvm.h, which effects address it through
+uint32_t frame[2][NUM_LEDS];
+uint32_t segmentRGB = 0xFF0000;   // parsed config.segmentColor, see applyConfig()
+
+// Theme: the color of every pixel is resolved into themeTable by
+// compileTheme() whenever the config changes, so drawing a digit is a
+// lookup. Gradients run left to right over twelve columns (three per
+// digit); segmentColumn places each segment bit of the two digit maps.
+uint32_t themeTable[2][NUM_LEDS];
+const uint8_t hourSegmentColumn[7] = {1, 2, 2, 1, 0, 0, 1};     // a b c d e f g
+const uint8_t minuteSegmentColumn[7] = {1, 0, 2, 1, 0, 2, 1};   // a f b g e c d
+
+uint32_t blendColor(uint32_t from, uint32_t to, uint16_t t) {   // t 0..256
+  uint32_t out = 0;
+  for (int shift = 0; shift <= 16; shift += 8) {
+    int a = (from >> shift) & 0xFF;
+    int b = (to >> shift) & 0xFF;
+    out |= (uint32_t)(a + (b - a) * t / 256) << shift;
+  }
+  return out;
+}
+
+// Night shift: how far the theme is blended toward nightColor, 0..255 for
+// every 15 minutes of the day. compileNightCurve() rebuilds it when the
+// schedule changes; updateDisplay() recompiles the theme table only when
+// the clock enters another slot.
+#define NIGHT_CURVE_SLOTS 96
+#define NIGHT_SLOT_MIN    (24 * 60 / NIGHT_CURVE_SLOTS)
+
+uint8_t nightCurve[NIGHT_CURVE_SLOTS];
+int nightSlot = 0;
+uint8_t nightWeight = 0;   // weight themeTable was compiled with
+
+void compileNightCurve() {
+  int start = config.nightStart * 60;
+  int end = config.nightEnd * 60;
+  int night = (end - start + 1440) % 1440;   // length of the full-strength span
+  for (int slot = 0; slot < NIGHT_CURVE_SLOTS; slot++) {
+    int m = slot * NIGHT_SLOT_MIN + NIGHT_SLOT_MIN / 2;
+    int sinceStart = (m - start + 1440) % 1440;
+    int untilStart = (start - m + 1440) % 1440;
+    int sinceEnd = (m - end + 1440) % 1440;
+    int w = 0;
+    if (sinceStart < night) w = 255;
+    else if (config.nightFade) w = max(0, 255 - 255 * min(untilStart, sinceEnd) / config.nightFade);
+    nightCurve[slot] = config.nightShift ? w : 0;
+  }
+}
+
+// Calibration: a white point per strip (per-channel gains, for LEDs from
+// different batches) and a display gamma. compileCalibration() turns them
+// into gammaLut and calGain, which outputFrame() applies exactly once per
+// pixel on the way to the strips. The theme table, the frame and everything
+// an effect reads or writes stay in plain config colors. Splitting gamma
+// between color and brightness is exact because (b * c)^g = b^g * c^g.
+uint8_t gammaLut[256];
+uint16_t calGain[2][3];   // 0..256 per strip, R G B
+
+void compileCalibration() {
+  for (int i = 0; i < 256; i++) gammaLut[i] = lroundf(powf(i / 255.0f, config.gamma) * 255);
+  uint32_t white[2] = {parseColor(config.hourWhite), parseColor(config.minuteWhite)};
+  for (int s = 0; s < 2; s++) {
+    for (int ch = 0; ch < 3; ch++) {
+      uint8_t v = white[s] >> (16 - 8 * ch);
+      calGain[s][ch] = v + (v >> 7);
+    }
+  }
+}
+
+void compileTheme() {
+  uint32_t digitRGB[4] = {segmentRGB, segmentRGB, segmentRGB, segmentRGB};
+  if (config.digitColors.length() == 4 * 8 - 1) {   // normalized by parseDigitColors()
+    for (int d = 0; d < 4; d++) digitRGB[d] = parseColor(config.digitColors.substring(d * 8, d * 8 + 7));
+  }
+  uint32_t gradientRGB = parseColor(config.gradientColor);
+  bool gradient = config.theme == "gradient";
+  bool perDigit = config.theme == "digits";
+  for (int d = 0; d < 4; d++) {
+    const uint8_t *order = d < 2 ? hourSegmentOrder : minuteSegmentOrder;
+    const uint8_t *column = d < 2 ? hourSegmentColumn : minuteSegmentColumn;
+    for (int i = 0; i < 7; i++) {
+      uint32_t c = segmentRGB;
+      if (perDigit) c = digitRGB[d];
+      else if (gradient) c = blendColor(segmentRGB, gradientRGB, (d * 3 + column[i]) * 256 / 11);
+      themeTable[digitStripIndex[d]][digitStartIndex[d] + order[i]] = c;
+    }
+  }
+  uint32_t dot = gradient ? blendColor(segmentRGB, gradientRGB, 128) : segmentRGB;
+  if (config.dotColor.length()) dot = parseColor(config.dotColor);
+  themeTable[HOUR_STRIP][0] = themeTable[MINUTE_STRIP][0] = dot;
+  uint8_t w = nightWeight = nightCurve[nightSlot];
+  if (w) {
+    uint32_t nightRGB = parseColor(config.nightColor);
+    for (auto &strip : themeTable) {
+      for (auto &c : strip) c = blendColor(c, nightRGB, w + (w >> 7));   // 255 is fully shifted
+    }
+  }
+}
+
+struct FrameInput {
+  int8_t digits[4];   // h1 h2 m1 m2, -1 leaves the digit dark
+  bool dots;
+  uint8_t brightness;
+};
+
+FrameInput lastFrame = {{-1, -1, -1, -1}, false, 0};
+
+struct FrameStats {
+  uint32_t frames = 0;
+  uint32_t lastUs = 0;
+  uint32_t minUs = UINT32_MAX;
+  uint32_t maxUs = 0;
+  uint64_t totalUs = 0;
+};
+
+FrameStats frameStats;
+
+void recordFrameTime(FrameStats &st, uint32_t cycles) {
+  uint32_t us = cycles / ESP.getCpuFreqMHz();
+  st.frames++;
+  st.lastUs = us;
+  st.totalUs += us;
+  if (us < st.minUs) st.minUs = us;
+  if (us > st.maxUs) st.maxUs = us;
+}
+
+HOT_PATH void drawDigit(int strip, int startIndex, int digit, bool isMinute = false) {
+  uint8_t segments = isMinute ? minuteSegmentMap[digit] : segmentMap[digit];
+  const uint8_t* mapping = isMinute ? minuteSegmentOrder : hourSegmentOrder;
+  uint32_t *pixels = frame[strip] + startIndex;
+  const uint32_t *colors = themeTable[strip] + startIndex;
+  for (int i = 0; i < 7; i++) {
+    bool on = (segments >> (6 - i)) & 1;
+    pixels[mapping[i]] = on ? colors[mapping[i]] : 0;
+  }
+}
+
+HOT_PATH void composeFrame(const FrameInput &in) {
+  memset(frame, 0, sizeof(frame));
+  frame[HOUR_STRIP][0] = in.dots ? themeTable[HOUR_STRIP][0] : 0;
+  frame[MINUTE_STRIP][0] = in.dots ? themeTable[MINUTE_STRIP][0] : 0;
+  if (in.digits[0] >= 0) drawDigit(HOUR_STRIP, 8, in.digits[0]);
+  if (in.digits[1] >= 0) drawDigit(HOUR_STRIP, 1, in.digits[1]);
+  if (in.digits[2] >= 0) drawDigit(MINUTE_STRIP, 1, in.digits[2], true);
+  if (in.digits[3] >= 0) drawDigit(MINUTE_STRIP, 8, in.digits[3], true);
+}
+
+// Calibrates the frame and scales it by brightness into the strips' pixel
+// buffers itself instead of calling setPixelColor() per pixel and rescaling
+// in setBrightness(). Brightness goes through the same gamma as the colors
+// and is folded into the strip's white point gains once per frame.
+HOT_PATH void outputFrame(uint8_t brightness) {
+  uint16_t scale = gammaLut[brightness] + 1;
+  Adafruit_NeoPixel *strips[2] = {&hourStrip, &minuteStrip};
+  for (int s = 0; s < 2; s++) {
+    uint16_t gain[3];   // R G B, 0..256
+    for (int ch = 0; ch < 3; ch++) gain[ch] = (calGain[s][ch] * scale) >> 8;
+    uint8_t *p = strips[s]->getPixels();
+    for (int i = 0; i < NUM_LEDS; i++) {
+      uint32_t c = frame[s][i];
+      *p++ = (gammaLut[(c >> 8) & 0xFF] * gain[1]) >> 8;    // G
+      *p++ = (gammaLut[(c >> 16) & 0xFF] * gain[0]) >> 8;   // R
+      *p++ = (gammaLut[c & 0xFF] * gain[2]) >> 8;           // B
+    }
+    strips[s]->show();
+  }
+}
+
+// Effects: programs uploaded to /api/effect and kept in /effect.bin, run by
+// the interpreter in effectvm.h at their own frame period. A frame that
+// runs out of budget is output as far as it got; any other fault unloads
+// the effect.
+#define EFFECT_PATH        "/effect.bin"
+
+struct EffectStats {
+  uint32_t overruns = 0;
+  uint32_t faults = 0;
+  uint16_t lastSteps = 0;
+  uint16_t maxSteps = 0;
+  FrameStats time;
+};
+
+Effect effect;
+EffectStats effectStats;
+
+bool effectLoad(const uint8_t *data, size_t len) {
+  if (!effectParse(effect, data, len)) return false;
+  effectStats = EffectStats();
+  return true;
+}
+
+// Writes the loaded program back in the upload format, or removes the file
+void effectSaveFile() {
+  if (!effect.loaded) {
+    LittleFS.remove(EFFECT_PATH);
+    return;
+  }
+  File f = LittleFS.open(EFFECT_PATH, "w");
+  if (!f) return;
+  uint8_t header[EFFECT_HEADER_SIZE];
+  memcpy(header, EFFECT_MAGIC, 4);
+  header[4] = EFFECT_VERSION;
+  header[5] = effect.frameMs / 10;
+  header[6] = effect.codeLen;
+  header[7] = effect.codeLen >> 8;
+  f.write(header, sizeof(header));
+  f.write(effect.code, effect.codeLen);
+  f.close();
+}
+
+void effectLoadFile() {
+  File f = LittleFS.open(EFFECT_PATH, "r");
+  if (!f) return;
+  uint8_t buf[EFFECT_HEADER_SIZE + EFFECT_CODE_MAX];
+  size_t len = f.read(buf, sizeof(buf));
+  f.close();
+  if (effectLoad(buf, len)) LOG(LOG_INFO, "Effect loaded: %u bytes, %u ms frames", effect.codeLen, effect.frameMs);
+  else LOG(LOG_WARN, "Effect in %s is invalid, ignored", EFFECT_PATH);
+}
+
+void effectInputs(const FrameInput &in, int32_t *inputs) {
+  struct timeval tv;
+  struct tm t;
+  gettimeofday(&tv, nullptr);
+  localtime_r(&tv.tv_sec, &t);
+  inputs[IN_HOUR] = t.tm_hour;
+  inputs[IN_MINUTE] = t.tm_min;
+  inputs[IN_SECOND] = t.tm_sec;
+  inputs[IN_MILLIS] = tv.tv_usec / 1000;
+  inputs[IN_FRAME] = effect.frame++;
+  inputs[IN_COLOR] = segmentRGB;
+  inputs[IN_DOTS] = in.dots;
+  inputs[IN_BRIGHTNESS] = in.brightness;
+}
+
+void effectApply(const int32_t *inputs, FrameStats &st) {
+  uint16_t steps;
+  uint32_t start = ESP.getCycleCount();
+  EffectResult r = effectRun(effect, frame, inputs, steps);
+  recordFrameTime(st, ESP.getCycleCount() - start);
+  effectStats.lastSteps = steps;
+  if (steps > effectStats.maxSteps) effectStats.maxSteps = steps;
+  if (r == EFFECT_OVERRUN) effectStats.overruns++;
+  if (r == EFFECT_FAULT) {
+    effectStats.faults++;
+    effect.loaded = false;
+    LOG(LOG_WARN, "Effect faulted after %u instructions, unloaded", steps);
+  }
+}
+
+void renderFrame(const FrameInput &in) {
+  bootProfileMark(BOOT_FIRST_FRAME);
+  int32_t inputs[IN_COUNT];
+  if (effect.loaded) effectInputs(in, inputs);
+  uint32_t start = ESP.getCycleCount();
+  composeFrame(in);
+  if (effect.loaded) effectApply(inputs, effectStats.time);
+  outputFrame(in.brightness);
+  recordFrameTime(frameStats, ESP.getCycleCount() - start);
+  lastFrame = in;
+}
+
+// Setup state while provisioning: four dashes waiting for credentials,
+// a single dash stepping across the digits while joining. A clock that
+// still has the time keeps showing it while it waits.
+void renderSetupFrame() {
+  static uint8_t step = 0;
+  FrameInput in;
+  step = (step + 1) % 4;
+  for (int d = 0; d < 4; d++) {
+    in.digits[d] = provision.state == PROV_JOINING && d != step ? -1 : GLYPH_DASH;
+  }
+  in.dots = dotState;
+  in.brightness = config.brightness;
+  renderFrame(in);
+}
+
+void updateDisplay() {
+  if (provision.state == PROV_JOINING || (provision.state == PROV_WAITING && !timeState.synced)) {
+    renderSetupFrame();
+    return;
+  }
+  struct tm timeinfo;
+  if (!getLocalTime(&timeinfo, 0)) return;
+
+  int hour = timeinfo.tm_hour;
+  if (!config.use24h) {
+    if (hour > 12) hour -= 12;
+    if (hour == 0) hour = 12;
+  }
+  int minute = timeinfo.tm_min;
+  int h1 = hour / 10;
+  int slot = (timeinfo.tm_hour * 60 + minute) / NIGHT_SLOT_MIN;
+  if (slot != nightSlot) {
+    nightSlot = slot;
+    if (nightCurve[slot] != nightWeight) compileTheme();
+  }
+
+  FrameInput in;
+  in.digits[0] = (h1 > 0 || (config.use24h && !config.hideLeadingZero24h)) ? h1 : -1;
+  in.digits[1] = hour % 10;
+  in.digits[2] = minute / 10;
+  in.digits[3] = minute % 10;
+  in.dots = dotState;
+  in.brightness = config.brightness;
+  if (config.autoDim && (timeinfo.tm_hour >= config.dimStartHour || timeinfo.tm_hour < config.dimEndHour)) {
+    in.brightness = config.brightness / 3;
+  }
+  renderFrame(in);
+}
+
+// Re-renders the last frame `frames` times and reports the spread of frame
+// times. With fsLoad, every frame is preceded by a flushed LittleFS write so
+// the flash cache is contended the way it is while config or logs are saved.
+struct BenchRequest {
+  bool pending = false;
+  uint16_t frames = 200;
+  bool fsLoad = true;
+};
+
+BenchRequest benchRequest;
+FrameStats benchStats;
+FrameStats benchEffectStats;   // interpreter share of benchStats
+bool benchFsLoad = false;
+
+void runFrameBenchmark(uint16_t frames, bool fsLoad) {
+  FrameStats st;
+  FrameStats effectSt;
+  int32_t inputs[IN_COUNT];
+  File scratch;
+  uint8_t chunk[256];
+  memset(chunk, 0xA5, sizeof(chunk));
+  if (fsLoad) scratch = LittleFS.open("/bench.tmp", "w");
+  for (uint16_t i = 0; i < frames; i++) {
+    if (scratch) {
+      scratch.write(chunk, sizeof(chunk));
+      scratch.flush();
+    }
+    if (effect.loaded) effectInputs(lastFrame, inputs);
+    uint32_t start = ESP.getCycleCount();
+    composeFrame(lastFrame);
+    if (effect.loaded) effectApply(inputs, effectSt);
+    outputFrame(lastFrame.brightness);
+    recordFrameTime(st, ESP.getCycleCount() - start);
+    yield();
+  }
+  if (scratch) {
+    scratch.close();
+    LittleFS.remove("/bench.tmp");
+  }
+  benchStats = st;
+  benchEffectStats = effectSt;
+  benchFsLoad = fsLoad;
+}
+
+void addFrameStats(JsonObject out, const FrameStats &st) {
+  out["frames"] = st.frames;
+  out["lastUs"] = st.lastUs;
+  out["minUs"] = st.frames ? st.minUs : 0;
+  out["maxUs"] = st.maxUs;
+  out["avgUs"] = st.frames ? (uint32_t)(st.totalUs / st.frames) : 0;
+  out["jitterUs"] = st.frames ? st.maxUs - st.minUs : 0;
+}
+
+String themeJson() {
+  JsonDocument doc;
+  doc["theme"] = config.theme;
+  doc["color"] = config.segmentColor;
+  doc["digitColors"] = config.digitColors;
+  doc["gradientColor"] = config.gradientColor;
+  doc["dotColor"] = config.dotColor;
+  doc["nightShift"] = config.nightShift;
+  doc["nightColor"] = config.nightColor;
+  doc["nightStart"] = config.nightStart;
+  doc["nightEnd"] = config.nightEnd;
+  doc["nightFade"] = config.nightFade;
+  doc["nightWeight"] = nightCurve[nightSlot];
+  doc["hourWhite"] = config.hourWhite;
+  doc["minuteWhite"] = config.minuteWhite;
+  doc["gamma"] = config.gamma;
+  JsonArray strips = doc["pixels"].to<JsonArray>();
+  for (int s = 0; s < 2; s++) {
+    JsonArray px = strips.add<JsonArray>();
+    for (int i = 0; i < NUM_LEDS; i++) {
+      char hex[8];
+      snprintf(hex, sizeof(hex), "#%06X", themeTable[s][i]);
+      px.add(hex);
+    }
+  }
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+void effectJson(JsonObject out) {
+  out["loaded"] = effect.loaded;
+  out["frameMs"] = effect.frameMs;
+  out["codeBytes"] = effect.loaded ? effect.codeLen : 0;
+  out["budget"] = EFFECT_BUDGET;
+  out["lastSteps"] = effectStats.lastSteps;
+  out["maxSteps"] = effectStats.maxSteps;
+  out["overruns"] = effectStats.overruns;
+  out["faults"] = effectStats.faults;
+  addFrameStats(out["time"].to<JsonObject>(), effectStats.time);
+}
+
+#if FEATURE_KEEPALIVE_API
+void apiJson(JsonObject out);
+#endif
+
+String metricsJson() {
+  JsonDocument doc;
+  doc["uptimeMs"] = monoUs() / 1000;
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["maxFreeBlock"] = ESP.getMaxFreeBlockSize();
+  doc["heapFragmentation"] = ESP.getHeapFragmentation();
+  doc["renderInIram"] = RENDER_IN_IRAM ? true : false;
+  doc["consoleTxDropped"] = consoleTxDropped;
+  doc["configGeneration"] = configGeneration;
+  doc["configSchema"] = CONFIG_SCHEMA;
+  JsonObject bus = doc["bus"].to<JsonObject>();
+  bus["published"] = busStats.published;
+  bus["dropped"] = busStats.dropped;
+  bus["maxQueued"] = busStats.maxQueued;
+  JsonObject ev = doc["events"].to<JsonObject>();
+  ev["newest"] = eventSeq;
+  ev["queued"] = eventQueued;
+  ev["dropped"] = eventStats.dropped;
+  ev["flushes"] = eventStats.flushes;
+#if FEATURE_KEEPALIVE_API
+  apiJson(doc["api"].to<JsonObject>());
+#endif
+  JsonObject w = doc["wifi"].to<JsonObject>();
+  w["rssi"] = WiFi.RSSI();
+  w["scans"] = wifiState.scans;
+  w["joins"] = wifiState.joins;
+  w["roams"] = wifiState.roams;
+  JsonObject sl = doc["syslog"].to<JsonObject>();
+  sl["queued"] = syslogStats.queued;
+  sl["dropped"] = syslogStats.dropped;
+  sl["datagrams"] = syslogStats.datagrams;
+  sl["buffered"] = syslogUsed();
+  JsonArray subs = doc["logSubscribers"].to<JsonArray>();
+  for (auto &sub : logSubs) {
+    if (!sub.clientId) continue;
+    JsonObject o = subs.add<JsonObject>();
+    o["id"] = sub.clientId;
+    o["level"] = logLevelNames[sub.level];
+    o["dropped"] = sub.droppedTotal;
+  }
+  addFrameStats(doc["frame"].to<JsonObject>(), frameStats);
+  effectJson(doc["effect"].to<JsonObject>());
+  JsonObject t = doc["time"].to<JsonObject>();
+  t["synced"] = timeState.synced;
+  t["stratum"] = timeState.stratum;
+  t["lastOffsetUs"] = timeState.lastOffsetUs;
+  t["lastDelayUs"] = timeState.lastDelayUs;
+  t["syncAgeMs"] = timeState.synced ? (monoUs() - timeState.lastSyncUs) / 1000 : 0;
+  t["syncs"] = timeState.syncs;
+  t["failures"] = timeState.failures;
+  t["served"] = timeState.served;
+  t["source"] = timeState.source == TIME_SRC_NTP ? "ntp" : timeState.source == TIME_SRC_HTTP ? "http" : "none";
+  t["driftPpb"] = drift.ppb;
+  t["driftSamples"] = drift.samples;
+  t["syncBackoff"] = syncBackoff;
+  t["driftLogSeq"] = driftLogSeq;
+  t["leapPending"] = leap.pending;
+  t["leapAt"] = (uint32_t)leap.at;
+  t["leapSmearUs"] = (int32_t)leap.appliedUs;
+  JsonObject d = doc["dns"].to<JsonObject>();
+  d["hits"] = dnsStats.hits;
+  d["staleHits"] = dnsStats.staleHits;
+  d["misses"] = dnsStats.misses;
+  d["failures"] = dnsStats.failures;
+  d["resolves"] = dnsStats.resolves;
+  d["lastLatencyUs"] = dnsStats.lastLatencyUs;
+  d["maxLatencyUs"] = dnsStats.maxLatencyUs;
+  d["avgLatencyUs"] = dnsStats.resolves ? (uint32_t)(dnsStats.totalLatencyUs / dnsStats.resolves) : 0;
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+String benchJson() {
+  JsonDocument doc;
+  doc["pending"] = benchRequest.pending;
+  doc["renderInIram"] = RENDER_IN_IRAM ? true : false;
+  doc["fsLoad"] = benchFsLoad;
+  addFrameStats(doc["frame"].to<JsonObject>(), benchStats);
+  if (benchEffectStats.frames) addFrameStats(doc["effect"].to<JsonObject>(), benchEffectStats);
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+// Compact status for /api/status, which fleet aggregators query on every clock
+String statusJson() {
+  JsonDocument doc;
+  time_t now = time(nullptr);
+  doc["name"] = clockName();
+  doc["ip"] = WiFi.localIP().toString();
+  doc["uptimeS"] = (uint32_t)(monoUs() / 1000000);
+  doc["time"] = (uint32_t)(now > 1600000000 ? now : 0);
+  doc["synced"] = timeState.synced;
+  doc["source"] = timeState.source == TIME_SRC_NTP ? "ntp" : timeState.source == TIME_SRC_HTTP ? "http" : "none";
+  doc["stratum"] = timeState.stratum;
+  doc["offsetUs"] = timeState.lastOffsetUs;
+  doc["syncAgeS"] = timeState.synced ? (uint32_t)((monoUs() - timeState.lastSyncUs) / 1000000) : 0;
+  doc["ssid"] = WiFi.SSID();
+  doc["rssi"] = WiFi.RSSI();
+  doc["freeHeap"] = ESP.getFreeHeap();
+  doc["brightness"] = config.brightness;
+  doc["theme"] = config.theme;
+  doc["configGeneration"] = configGeneration;
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+String bootJson() {
+  JsonDocument doc;
+  doc["resetReason"] = ESP.getResetReason();
+  bootProfileJson(bootProfile, doc["current"].to<JsonObject>());
+  if (bootPrevious.magic) bootProfileJson(bootPrevious, doc["previous"].to<JsonObject>());
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+String effectStatusJson() {
+  JsonDocument doc;
+  effectJson(doc.to<JsonObject>());
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+void applyConfig() {
+  segmentRGB = parseColor(config.segmentColor);
+  compileCalibration();
+  compileNightCurve();
+  compileTheme();
+  logUpdateMaxLevel();
+}
+
+// A filesystem image replaces every file with whatever data/ held at build
+// time. fsImageBegin() keeps the newest NTP drift records in RAM before the
+// filesystem is unmounted; fsImageInstalled() remounts it, picks up the
+// (empty) log segments of the new image and writes the running state back:
+// settings, the known WiFi networks (the SDK keeps no copy, see
+// wifiLoadNetworks()), the loaded effect, the queued events and the carried
+// drift records, so the estimator is still seeded after the reboot. Older
+// event and drift history goes with the old image.
+DriftRecord driftCarry[DRIFT_LOG_SEED_COUNT];
+uint8_t driftCarryCount = 0;
+
+void fsImageBegin() {
+  driftCarryCount = 0;
+  DriftRecord r;
+  for (uint32_t seq = driftLogSeq; seq > 0 && driftCarryCount < DRIFT_LOG_SEED_COUNT && driftLogRead(seq, r); seq--) {
+    if (r.source == TIME_SRC_NTP) driftCarry[driftCarryCount++] = r;
+  }
+  LittleFS.end();
+}
+
+void fsImageInstalled() {
+  LittleFS.begin();
+  eventLogLoad();
+  driftLogLoad();
+  while (driftCarryCount) driftLogWrite(driftCarry[--driftCarryCount]);   // oldest first
+  saveConfig();
+  wifiSaveNetworks();
+  effectSaveFile();
+  eventFlush();
+}
+
+uint8_t effectUpload[EFFECT_HEADER_SIZE + EFFECT_CODE_MAX];
+size_t effectUploadLen = 0;
+
+// Setting values arrive as JSON; setConfigField() takes them as text
+String jsonValueString(JsonVariantConst v) {
+  if (v.is<const char *>()) return v.as<const char *>();
+  String out;
+  serializeJson(v, out);
+  return out;
+}
+
+// Collects a JSON request body in the request's temp object, which the
+// server frees with the request. Bodies over API_BODY_MAX are not kept.
+#define API_BODY_MAX 2048
+
+void collectBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+  if (total > API_BODY_MAX) return;
+  if (!index) request->_tempObject = malloc(total + 1);
+  if (!request->_tempObject) return;
+  memcpy((uint8_t *)request->_tempObject + index, data, len);
+  if (index + len == total) ((char *)request->_tempObject)[total] = '\0';
+}
+
+// Runs a /api/batch request: a JSON array of {"op": "set", "key", "value"}
+// and {"op": "toggle", "key"} operations on config.json keys. All of them
+// are applied to a copy of the config; only if every one succeeds does the
+// copy replace the config, which is then saved and applied once.
+int runBatch(const char *body, JsonDocument &reply) {
+  JsonDocument req;
+  if (deserializeJson(req, body) || !req.is<JsonArrayConst>()) {
+    reply["error"] = "body must be a JSON array of operations";
+    return 400;
+  }
+  ClockConfig next = config;
+  int index = 0;
+  for (JsonVariantConst item : req.as<JsonArrayConst>()) {
+    JsonObjectConst op = item.as<JsonObjectConst>();
+    String name = op["op"] | "";
+    String key = op["key"] | "";
+    String value;
+    if (name == "set") {
+      value = jsonValueString(op["value"]);
+    } else if (name == "toggle") {
+      JsonDocument current;
+      configToJson(next, current.to<JsonObject>());
+      if (!current[key].is<bool>()) {
+        reply["error"] = "toggle needs a boolean key";
+        reply["index"] = index;
+        return 400;
+      }
+      value = current[key].as<bool>() ? "false" : "true";
+    } else {
+      reply["error"] = "unknown op";
+      reply["index"] = index;
+      return 400;
+    }
+    if (!setConfigField(next, key, value)) {
+      reply["error"] = "invalid key or value";
+      reply["index"] = index;
+      return 400;
+    }
+    index++;
+  }
+  // A batch that leaves every field as it was is not saved and keeps the generation
+  JsonDocument before, after;
+  configToJson(config, before.to<JsonObject>());
+  configToJson(next, after.to<JsonObject>());
+  String beforeText, afterText;
+  serializeJson(before, beforeText);
+  serializeJson(after, afterText);
+  bool changed = beforeText != afterText;
+  if (changed) {
+    bool timeChanged = next.timezone != config.timezone || next.ntpServer != config.ntpServer;
+    config = next;
+    configCommit(timeChanged ? CONFIG_TIME : 0);
+  }
+  reply["applied"] = index;
+  reply["changed"] = changed;
+  reply["generation"] = configGeneration;
+  return 200;
+}
+
+// Backup bundle for /api/config: the config.json settings plus the schema
+// they follow, so an export can be restored by a later firmware.
+String configBundleJson() {
+  JsonDocument doc;
+  doc["format"] = "7sclock-config";
+  doc["schema"] = CONFIG_SCHEMA;
+  doc["generation"] = configGeneration;
+  configToJson(config, doc["config"].to<JsonObject>());
+  String out;
+  serializeJson(doc, out);
+  return out;
+}
+
+// Restores a bundle, or a bare config.json, of this or an older schema.
+// Keys it does not contain get their defaults; every value is validated
+// before anything is replaced.
+int restoreConfig(const char *body, JsonDocument &reply) {
+  JsonDocument in;
+  if (deserializeJson(in, body) || !in.is<JsonObjectConst>()) {
+    reply["error"] = "body must be a config bundle";
+    return 400;
+  }
+  JsonDocument doc;
+  if (in["config"].is<JsonObjectConst>()) {
+    doc.set(in["config"]);
+    doc["schema"] = in["schema"] | 0;
+  } else {
+    doc.set(in);
+  }
+  if ((doc["schema"] | 0) > CONFIG_SCHEMA) {
+    reply["error"] = "bundle is from a newer firmware";
+    return 400;
+  }
+  migrateConfig(doc);
+  ClockConfig next;
+  for (JsonPairConst kv : doc.as<JsonObjectConst>()) {
+    String key = kv.key().c_str();
+    if (key == "schema" || key == "generation") continue;
+    if (!setConfigField(next, key, jsonValueString(kv.value()))) {
+      reply["error"] = "invalid value";
+      reply["key"] = key;
+      return 400;
+    }
+  }
+  config = next;
+  configCommit(CONFIG_TIME);
+  reply["generation"] = configGeneration;
+  return 200;
+}
 
-const uint8_t segmentMap[10] = {
-    0b1111110, 0b0110000, 0b1101101, 0b1111001, 0b0110011,
-    0b1011011, 0b1011111, 0b1110000, 0b1111111, 0b1111011
-};
+#if FEATURE_FLEET
+// Fleet view: with config.fleet set, this clock browses _7sclock._tcp,
+// which every clock advertises, and collects the other clocks' /api/status
+// for /fleet and /api/fleet. Queries run concurrently on AsyncClient, at
+// most FLEET_FETCH_MAX at a time, and each answer is cached for
+// FLEET_TTL_US however often the page reloads. Peers are only queried
+// while someone has looked at the fleet within FLEET_WATCH_US, so an
+// unwatched aggregator adds no traffic beyond mDNS.
+#define FLEET_PEERS_MAX   16
+#define FLEET_FETCH_MAX   4
+#define FLEET_TTL_US      SEC_US(30)
+#define FLEET_WATCH_US    SEC_US(120)
+#define FLEET_TIMEOUT_US  SEC_US(3)
+#define FLEET_BROWSE_US   SEC_US(10)    // how often mDNS answers are read into the peer table
+#define FLEET_FORGET_US   SEC_US(600)   // peers not announced this long are dropped
+#define FLEET_REPLY_MAX   1024
 
-const uint8_t minuteSegmentMap[10] = {
-    0b1110111, 0b0010010, 0b1011101, 0b1011011, 0b0111010,
-    0b1101011, 0b1101111, 0b1010010, 0b1111111, 0b1111011
+struct FleetPeer {
+  String host;
+  IPAddress ip;
+  uint16_t port = 80;
+  uint64_t seenUs = 0;       // last mDNS answer, 0 marks a free slot
+  uint64_t fetchedUs = 0;    // last finished query, good or not
+  uint64_t startUs = 0;
+  uint32_t latencyUs = 0;
+  bool ok = false;           // the last query succeeded
+  String status;             // body of the last good query
+  String rx;
+  AsyncClient *client = nullptr;
 };
 
-struct ClockConfig {
-  String timezone = "CET-1CEST,M3.5.0,M10.5.0/3";
-  String ntpServer = "pool.ntp.org";
-  bool blinkDots = true;
-  uint8_t brightness = 50;
-  String segmentColor = "#FF0000";
-  bool use24h = false;
-  bool hideLeadingZero24h = false;
-  bool autoDim = true;
-  uint8_t dimStartHour = 22;
-  uint8_t dimEndHour = 6;
-  uint32_t ntpSyncInterval = 60;
+struct FleetStats {
+  uint32_t queries = 0;
+  uint32_t failures = 0;
 };
 
-ClockConfig config;
-bool dotState = true;
+FleetPeer fleetPeers[FLEET_PEERS_MAX];
+FleetStats fleetStats;
+MDNSResponder::hMDNSServiceQuery fleetQuery = nullptr;
+uint64_t fleetWatchedUs = 0;   // last /api/fleet request
 
-void saveConfig() {
-  File f = LittleFS.open("/config.json", "w");
-  if (f) {
-    f.printf("{\"timezone\":\"%s\",\"ntpServer\":\"%s\",\"blinkDots\":%s,\"brightness\":%d,\"color\":\"%s\",\"use24h\":%s,\"hideLeadingZero24h\":%s,\"autoDim\":%s,\"dimStart\":%d,\"dimEnd\":%d,\"ntpSyncInterval\":%u}",
-             config.timezone.c_str(), config.ntpServer.c_str(), config.blinkDots ? "true" : "false",
-             config.brightness, config.segmentColor.c_str(), config.use24h ? "true" : "false",
-             config.hideLeadingZero24h ? "true" : "false", config.autoDim ? "true" : "false",
-             config.dimStartHour, config.dimEndHour, config.ntpSyncInterval);
-    f.close();
+// Reads the mDNS answers into the peer table, matched by address: host
+// names only label the list, two clocks may well announce the same one
+void fleetBrowse(uint64_t now) {
+  uint32_t n = MDNS.answerCount(fleetQuery);
+  for (uint32_t i = 0; i < n; i++) {
+    if (!MDNS.hasAnswerHostDomain(fleetQuery, i) || !MDNS.hasAnswerIP4Address(fleetQuery, i)) continue;
+    IPAddress ip = MDNS.answerIP4Address(fleetQuery, i, 0);
+    if (ip == WiFi.localIP()) continue;
+    String host = MDNS.answerHostDomain(fleetQuery, i);
+    FleetPeer *peer = nullptr;
+    for (auto &p : fleetPeers) {
+      if (p.seenUs && p.ip == ip) {
+        peer = &p;
+        break;
+      }
+    }
+    for (auto &p : fleetPeers) {
+      if (peer) break;
+      if (p.seenUs || p.client) continue;
+      peer = &p;
+      *peer = FleetPeer();
+      peer->ip = ip;
+    }
+    if (!peer) continue;
+    peer->host = host;
+    if (MDNS.hasAnswerPort(fleetQuery, i)) peer->port = MDNS.answerPort(fleetQuery, i);
+    peer->seenUs = now;
+  }
+  for (auto &p : fleetPeers) {
+    if (p.seenUs && !p.client && now - p.seenUs > FLEET_FORGET_US) p.seenUs = 0;
   }
 }
 
-void loadConfig() {
-  if (!LittleFS.exists("/config.json")) return;
-  File f = LittleFS.open("/config.json", "r");
-  if (!f) return;
-  String data = f.readString();
-  f.close();
+// Takes the body of a finished query if it is a 200 with valid JSON
+void fleetFinish(FleetPeer &p) {
+  uint64_t now = monoUs();
+  int body = p.rx.indexOf("\r\n\r\n");
   JsonDocument doc;
-  deserializeJson(doc, data);
-  config.timezone = doc["timezone"].as<String>();
-  config.ntpServer = doc["ntpServer"].as<String>();
-  config.blinkDots = doc["blinkDots"] | true;
-  config.brightness = doc["brightness"] | 50;
-  config.segmentColor = doc["color"] | "#FF0000";
-  config.use24h = doc["use24h"] | true;
-  config.hideLeadingZero24h = doc["hideLeadingZero24h"] | true;
-  config.autoDim = doc["autoDim"] | true;
-  config.dimStartHour = doc["dimStart"] | 22;
-  config.dimEndHour = doc["dimEnd"] | 6;
-  config.ntpSyncInterval = doc["ntpSyncInterval"] | 60;
+  p.ok = p.rx.startsWith("HTTP/1.1 200") && body > 0 && !deserializeJson(doc, p.rx.c_str() + body + 4);
+  if (p.ok) {
+    p.status = p.rx.substring(body + 4);
+    p.latencyUs = now - p.startUs;
+  } else {
+    fleetStats.failures++;
+  }
+  p.fetchedUs = now;
+  p.rx = "";
 }
 
-uint32_t parseColor(String hexColor) {
-  hexColor.replace("#", "");
-  return strtoul(hexColor.c_str(), NULL, 16);
+void fleetFetch(FleetPeer &p, uint64_t now) {
+  AsyncClient *c = new AsyncClient();
+  p.client = c;
+  p.startUs = now;
+  p.rx = "";
+  fleetStats.queries++;
+  c->onConnect([](void *arg, AsyncClient *c) {
+    FleetPeer &p = *(FleetPeer *)arg;
+    String req = "GET /api/status HTTP/1.1\r\nHost: " + p.ip.toString() + "\r\nConnection: close\r\n\r\n";
+    c->write(req.c_str(), req.length());
+  }, &p);
+  c->onData([](void *arg, AsyncClient *c, void *data, size_t len) {
+    FleetPeer &p = *(FleetPeer *)arg;
+    if (p.rx.length() + len > FLEET_REPLY_MAX) {
+      c->close();
+      return;
+    }
+    p.rx.concat((const char *)data, len);
+  }, &p);
+  c->onDisconnect([](void *arg, AsyncClient *c) {
+    FleetPeer &p = *(FleetPeer *)arg;
+    fleetFinish(p);
+    p.client = nullptr;
+    delete c;
+  }, &p);
+  if (!c->connect(p.ip, p.port)) {
+    p.client = nullptr;
+    delete c;
+    fleetFinish(p);
+  }
 }
 
-String extractTag(const String& xml, const String& tag) {
-  int start = xml.indexOf("<" + tag + ">");
-  int end = xml.indexOf("</" + tag + ">");
-  if (start == -1 || end == -1 || end < start) return "";
-  start += tag.length() + 2;
-  String result = xml.substring(start, end);
-  result.trim();
-  return result;
+void fleetPoll(uint64_t now) {
+  static uint64_t lastBrowse = 0;
+  if (!config.fleet) {
+    if (fleetQuery) MDNS.removeServiceQuery(fleetQuery);
+    fleetQuery = nullptr;
+    return;
+  }
+  if (!fleetQuery) {
+    if (WiFi.isConnected()) fleetQuery = MDNS.installServiceQuery("7sclock", "tcp", [](const MDNSResponder::MDNSServiceInfo &, MDNSResponder::AnswerType, bool) {});
+    return;
+  }
+  if (now - lastBrowse >= FLEET_BROWSE_US) {
+    lastBrowse = now;
+    fleetBrowse(now);
+  }
+  uint8_t active = 0;
+  for (auto &p : fleetPeers) {
+    if (!p.client) continue;
+    active++;
+    if (now - p.startUs > FLEET_TIMEOUT_US) p.client->close(true);
+  }
+  if (!fleetWatchedUs || now - fleetWatchedUs > FLEET_WATCH_US) return;
+  for (auto &p : fleetPeers) {
+    if (active >= FLEET_FETCH_MAX) break;
+    if (!p.seenUs || p.client || (p.fetchedUs && now - p.fetchedUs < FLEET_TTL_US)) continue;
+    fleetFetch(p, now);
+    active++;
+  }
 }
 
-int extractIntFromTag(const String& xml, const String& tag) {
-  String valueStr = extractTag(xml, tag);
-  return valueStr.length() > 0 ? valueStr.toInt() : 0;
+// Answers from the cache only; asking also keeps the peer queries running
+String fleetJson() {
+  uint64_t now = monoUs();
+  fleetWatchedUs = now;
+  JsonDocument doc;
+  doc["enabled"] = config.fleet;
+  doc["ttlMs"] = (uint32_t)(FLEET_TTL_US / 1000);
+  doc["queries"] = fleetStats.queries;
+  doc["failures"] = fleetStats.failures;
+  doc["self"] = serialized(statusJson());
+  JsonArray peers = doc["peers"].to<JsonArray>();
+  for (auto &p : fleetPeers) {
+    if (!p.seenUs) continue;
+    JsonObject o = peers.add<JsonObject>();
+    o["host"] = p.host;
+    o["ip"] = p.ip.toString();
+    o["ok"] = p.ok;
+    o["pending"] = p.client != nullptr;
+    if (p.fetchedUs) o["ageMs"] = (uint32_t)((now - p.fetchedUs) / 1000);
+    if (p.ok) o["latencyMs"] = p.latencyUs / 1000;
+    if (p.status.length()) o["status"] = serialized(p.status);
+  }
+  String out;
+  serializeJson(doc, out);
+  return out;
 }
+#endif
 
-void sendSoapResponse(AsyncWebServerRequest *request, const String& actionName) {
-  String body = "<?xml version=\"1.0\" encoding=\"utf-8\"?>";
-  body += "<soap:Envelope xmlns:soap=\"http://schemas.xmlsoap.org/soap/envelope/\">";
-  body += "<soap:Body>";
-  body += "<u:" + actionName + "Response xmlns:u=\"urn:schemas-upnp-org:service:ClockControl:1\"/>";
-  body += "</soap:Body>";
-  body += "</soap:Envelope>";
-  request->send(200, "text/xml", body);
-}
+// Read-only JSON endpoints, served by setupWeb() on port 80 and by the
+// keep-alive listener on port 8080 from this one table
+struct ApiRoute {
+  const char *path;
+  String (*get)();
+  const char *download;      // file name for Content-Disposition on port 80, or nullptr
+};
 
-void setupTime() {
-  configTime(config.timezone.c_str(), config.ntpServer.c_str());
-}
+const ApiRoute apiRoutes[] = {
+  {"/api/metrics", metricsJson, nullptr},
+  {"/api/status", statusJson, nullptr},
+#if FEATURE_FLEET
+  {"/api/fleet", fleetJson, nullptr},
+#endif
+  {"/api/wifi", wifiJson, nullptr},
+  {"/api/provision", provisionJson, nullptr},
+  {"/api/theme", themeJson, nullptr},
+  {"/api/boot", bootJson, nullptr},
+  {"/api/effect", effectStatusJson, nullptr},
+  {"/api/bench", benchJson, nullptr},
+  {"/api/config", configBundleJson, "7sclock-config.json"},
+};
 
-const uint8_t hourSegmentOrder[7] = {1, 0, 4, 5, 6, 2, 3};
-const uint8_t minuteSegmentOrder[7] = {5, 4, 6, 3, 0, 2, 1};
+#if FEATURE_KEEPALIVE_API
+// Keep-alive API listener. ESPAsyncWebServer closes the connection after
+// every response, so pollers pay a TCP handshake and a fresh PCB per
+// request. Port 8080 serves the JSON API as HTTP/1.1 with persistent
+// connections: requests are parsed straight out of a per-session buffer,
+// pipelined requests are answered in order, and a session closes after
+// API_IDLE_US without a request or API_SESSION_REQUESTS requests.
+// Connections beyond API_SESSIONS_MAX, or when the receive buffer cannot
+// be allocated, get a 503 so they retry on port 80.
+#define API_PORT             8080
+#define API_SESSIONS_MAX     4
+#define API_RX_MAX           1024     // request line, headers and body; bounds pipelining depth too
+#define API_TX_HIGH          1460     // stop parsing while this much output waits for ACKs
+#define API_IDLE_US          SEC_US(5)
+#define API_SESSION_REQUESTS 100
 
-void drawDigit(Adafruit_NeoPixel &strip, int startIndex, int digit, bool isMinute = false) {
-  uint8_t segments = isMinute ? minuteSegmentMap[digit] : segmentMap[digit];
-  const uint8_t* mapping = isMinute ? minuteSegmentOrder : hourSegmentOrder;
-  for (int i = 0; i < 7; i++) {
-    bool on = (segments >> (6 - i)) & 1;
-    int ledIndex = startIndex + mapping[i];
-    strip.setPixelColor(ledIndex, on ? parseColor(config.segmentColor) : 0);
+struct ApiRequest {
+  char method[8];
+  char path[64];
+  bool keepAlive;
+  const char *body;
+  size_t bodyLen;
+};
+
+struct ApiSession {
+  AsyncClient *client = nullptr;
+  char *rx = nullptr;        // API_RX_MAX bytes while connected, so idle sessions cost no heap
+  size_t rxLen = 0;
+  String tx;                 // response bytes not yet handed to TCP
+  uint64_t lastUs = 0;
+  uint16_t requests = 0;
+  bool closing = false;      // close once tx has gone out
+};
+
+struct ApiStats {
+  uint32_t accepted = 0;
+  uint32_t refused = 0;      // over API_SESSIONS_MAX
+  uint32_t requests = 0;
+  uint32_t reused = 0;       // requests on an already used connection
+  uint32_t idleClosed = 0;
+  uint32_t errors = 0;       // malformed or oversized requests
+};
+
+AsyncServer apiServer(API_PORT);
+ApiSession apiSessions[API_SESSIONS_MAX];
+ApiStats apiStats;
+
+#define API_BAD_REQUEST  -1
+#define API_TOO_LARGE    -2
+
+// Parses the request at the start of buf. Returns its length with the body,
+// 0 while it is incomplete, or API_BAD_REQUEST / API_TOO_LARGE.
+int apiParseRequest(const char *buf, size_t len, ApiRequest &req) {
+  size_t end = 0;
+  while (end + 4 <= len && memcmp(buf + end, "\r\n\r\n", 4)) end++;
+  if (end + 4 > len) return len >= API_RX_MAX ? API_TOO_LARGE : 0;
+  const char *line = (const char *)memchr(buf, '\n', end + 2) + 1;
+  char first[96];
+  size_t firstLen = min((size_t)(line - buf), sizeof(first) - 1);
+  memcpy(first, buf, firstLen);
+  first[firstLen] = '\0';
+  int minor;
+  if (sscanf(first, "%7s %63s HTTP/1.%d", req.method, req.path, &minor) != 3) return API_BAD_REQUEST;
+  char *query = strchr(req.path, '?');
+  if (query) *query = '\0';
+  req.keepAlive = minor >= 1;
+  req.bodyLen = 0;
+  while (line < buf + end) {
+    const char *next = (const char *)memchr(line, '\n', buf + end + 2 - line) + 1;
+    if (!strncasecmp(line, "Content-Length:", 15)) {
+      // Digits only; anything else, a sign included, is malformed. The bound
+      // is checked before it is added, so a huge value cannot wrap `total`.
+      const char *value = line + 15;
+      while (*value == ' ' || *value == '\t') value++;
+      if (!isdigit((unsigned char)*value)) return API_BAD_REQUEST;
+      char *rest;
+      unsigned long n = strtoul(value, &rest, 10);
+      while (*rest == ' ' || *rest == '\t') rest++;
+      if (*rest != '\r' && *rest != '\n') return API_BAD_REQUEST;
+      if (n > API_RX_MAX - end - 4) return API_TOO_LARGE;
+      req.bodyLen = n;
+    }
+    if (!strncasecmp(line, "Connection:", 11)) {
+      String value;
+      value.concat(line + 11, next - line - 11);
+      value.toLowerCase();
+      if (value.indexOf("close") >= 0) req.keepAlive = false;
+      if (value.indexOf("keep-alive") >= 0) req.keepAlive = true;
+    }
+    line = next;
   }
+  size_t total = end + 4 + req.bodyLen;
+  if (total > API_RX_MAX) return API_TOO_LARGE;
+  if (total > len) return 0;
+  req.body = buf + end + 4;
+  return total;
 }
 
-void updateDisplay() {
-  struct tm timeinfo;
-  if (!getLocalTime(&timeinfo)) return;
+void apiAppendResponse(ApiSession &s, int status, const char *type, const String &body, bool keepAlive) {
+  const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found"
+                     : status == 405 ? "Method Not Allowed" : status == 413 ? "Payload Too Large" : "Service Unavailable";
+  char head[192];
+  int n = snprintf(head, sizeof(head), "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %u\r\n", status, reason, type, (unsigned)body.length());
+  if (keepAlive) n += snprintf(head + n, sizeof(head) - n, "Connection: keep-alive\r\nKeep-Alive: timeout=%u, max=%u\r\n\r\n",
+                               (unsigned)(API_IDLE_US / 1000000), (unsigned)(API_SESSION_REQUESTS - s.requests));
+  else n += snprintf(head + n, sizeof(head) - n, "Connection: close\r\n\r\n");
+  s.tx.concat(head, n);
+  s.tx += body;
+  if (!keepAlive) s.closing = true;
+}
 
-  int hour = timeinfo.tm_hour;
-  if (!config.use24h) {
-    if (hour > 12) hour -= 12;
-    if (hour == 0) hour = 12;
+void apiHandle(ApiSession &s, const ApiRequest &req) {
+  apiStats.requests++;
+  if (s.requests++) apiStats.reused++;
+  bool keepAlive = req.keepAlive && s.requests < API_SESSION_REQUESTS;
+  if (!strcmp(req.method, "POST") && !strcmp(req.path, "/api/batch")) {
+    JsonDocument reply;
+    String body;
+    body.concat(req.body, req.bodyLen);
+    int status = 400;
+    if (!req.bodyLen) reply["error"] = "missing body";
+    else status = runBatch(body.c_str(), reply);
+    String out;
+    serializeJson(reply, out);
+    apiAppendResponse(s, status, "application/json", out, keepAlive);
+    return;
   }
-  int minute = timeinfo.tm_min;
-  int h1 = hour / 10;
-  int h2 = hour % 10;
-  int m1 = minute / 10;
-  int m2 = minute % 10;
+  for (const ApiRoute &route : apiRoutes) {
+    if (strcmp(req.path, route.path)) continue;
+    if (strcmp(req.method, "GET")) apiAppendResponse(s, 405, "text/plain", "GET only\n", keepAlive);
+    else apiAppendResponse(s, 200, "application/json", route.get(), keepAlive);
+    return;
+  }
+  apiAppendResponse(s, 404, "text/plain", "Not found\n", keepAlive);
+}
+
+// Hands as much pending output to TCP as its send buffer takes
+void apiSend(ApiSession &s) {
+  if (s.tx.length()) {
+    size_t n = min(s.tx.length(), s.client->space());
+    if (n) {
+      s.client->add(s.tx.c_str(), n);
+      s.client->send();
+      s.tx.remove(0, n);
+    }
+  }
+  if (!s.tx.length() && s.closing) s.client->close();
+}
 
-  hourStrip.clear();
-  minuteStrip.clear();
-  hourStrip.setPixelColor(0, dotState ? parseColor(config.segmentColor) : 0);
-  minuteStrip.setPixelColor(0, dotState ? parseColor(config.segmentColor) : 0);
+// Answers every complete request in rx, in order, while the output backlog
+// stays small; the rest waits for ACKs
+void apiRun(ApiSession &s) {
+  ApiRequest req;
+  while (!s.closing && s.tx.length() < API_TX_HIGH) {
+    int used = apiParseRequest(s.rx, s.rxLen, req);
+    if (used == 0) break;
+    if (used < 0) {
+      apiStats.errors++;
+      apiAppendResponse(s, used == API_TOO_LARGE ? 413 : 400, "text/plain", "Bad request\n", false);
+      s.rxLen = 0;
+      break;
+    }
+    apiHandle(s, req);
+    memmove(s.rx, s.rx + used, s.rxLen - used);
+    s.rxLen -= used;
+  }
+  apiSend(s);
+}
 
-  if (h1 > 0 || (config.use24h && !config.hideLeadingZero24h)) drawDigit(hourStrip, 8, h1);
-  drawDigit(hourStrip, 1, h2);
-  drawDigit(minuteStrip, 1, m1, true);
-  drawDigit(minuteStrip, 8, m2, true);
+void apiAccept(void *, AsyncClient *c) {
+  ApiSession *s = nullptr;
+  for (auto &slot : apiSessions) {
+    if (!slot.client) {
+      s = &slot;
+      break;
+    }
+  }
+  if (s) s->rx = (char *)malloc(API_RX_MAX);
+  if (!s || !s->rx) {
+    apiStats.refused++;
+    static const char busy[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    c->onDisconnect([](void *, AsyncClient *c) { delete c; });
+    c->write(busy, sizeof(busy) - 1);
+    c->close();
+    return;
+  }
+  apiStats.accepted++;
+  s->client = c;
+  s->rxLen = 0;
+  s->tx = "";
+  s->requests = 0;
+  s->closing = false;
+  s->lastUs = monoUs();
+  c->setNoDelay(true);
+  c->onData([](void *arg, AsyncClient *, void *data, size_t len) {
+    ApiSession &s = *(ApiSession *)arg;
+    if (s.closing) return;   // answered with Connection: close, the rest is ignored
+    s.lastUs = monoUs();
+    if (len > API_RX_MAX - s.rxLen) {
+      // Pipelined deeper than rx holds; the stream cannot be resynced
+      apiStats.errors++;
+      s.rxLen = 0;
+      apiAppendResponse(s, 413, "text/plain", "Pipeline too deep\n", false);
+      apiSend(s);
+      return;
+    }
+    memcpy(s.rx + s.rxLen, data, len);
+    s.rxLen += len;
+    apiRun(s);
+  }, s);
+  c->onAck([](void *arg, AsyncClient *, size_t, uint32_t) {
+    apiRun(*(ApiSession *)arg);
+  }, s);
+  c->onDisconnect([](void *arg, AsyncClient *c) {
+    ApiSession &s = *(ApiSession *)arg;
+    s.client = nullptr;
+    s.tx = "";
+    free(s.rx);
+    s.rx = nullptr;
+    delete c;
+  }, s);
+}
 
-  int dynamicBrightness = config.brightness;
-  if (config.autoDim && (timeinfo.tm_hour >= config.dimStartHour || timeinfo.tm_hour < config.dimEndHour)) {
-    dynamicBrightness = config.brightness / 3;
+// Closes sessions that have been quiet for API_IDLE_US
+void apiPoll(uint64_t now) {
+  for (auto &s : apiSessions) {
+    if (!s.client || s.tx.length() || s.closing || now - s.lastUs < API_IDLE_US) continue;
+    apiStats.idleClosed++;
+    s.closing = true;
+    s.client->close();
   }
-  hourStrip.setBrightness(dynamicBrightness);
-  minuteStrip.setBrightness(dynamicBrightness);
+}
 
-  hourStrip.show();
-  minuteStrip.show();
+void apiJson(JsonObject out) {
+  uint8_t open = 0;
+  for (auto &s : apiSessions) open += s.client != nullptr;
+  out["port"] = API_PORT;
+  out["sessions"] = open;
+  out["accepted"] = apiStats.accepted;
+  out["refused"] = apiStats.refused;
+  out["requests"] = apiStats.requests;
+  out["reused"] = apiStats.reused;
+  out["idleClosed"] = apiStats.idleClosed;
+  out["errors"] = apiStats.errors;
 }
+#endif
 
 void setupWeb() {
+#if FEATURE_WEB_UI
   server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String html = R"rawliteral(
+    String html = F(R"rawliteral(
       <!DOCTYPE html>
       <html><head><meta name='viewport' content='width=device-width, initial-scale=1'><style>
       body { font-family: sans-serif; background: #111; color: #fff; padding: 1em; }
@@ -204,8 +3244,29 @@ void setupWeb() {
       </select>
       <label>NTP Server</label><input name='ntpServer' value='%NTPSERVER%'>
       <label>NTP Sync Interval (min)</label><input name='ntpSyncInterval' type='number' min='1' max='1440' value='%NTPSYNC%'>
+      <label><input type='checkbox' name='ntpServerMode' %NTPSERVERMODE%> Serve NTP to the LAN</label>
+      <label>Fallback time URL (HTTP Date, used when NTP is blocked)</label><input name='timeFallbackUrl' placeholder='http://192.168.1.1/' value='%TIMEFALLBACK%'>
+      <label>Leap second smear (hours, 0 = step)</label><input name='leapSmearHours' type='number' min='0' max='48' value='%LEAPSMEAR%'>
+      <label>Syslog collector (host, empty = off)</label><input name='syslogHost' value='%SYSLOGHOST%'>
+      <label>Syslog port</label><input name='syslogPort' type='number' min='1' max='65535' value='%SYSLOGPORT%'>
+      %FLEETOPTION%
+      <label>Roam below signal (dBm)</label><input name='wifiRoamRssi' type='number' min='-90' max='-40' value='%WIFIROAMRSSI%'>
       <label>LED Brightness</label><input type='range' name='brightness' min='5' max='255' value='%BRIGHTNESS%'>
       <label>LED Color</label><input type='color' name='color' value='%COLOR%'>
+      <label>Theme</label><select name='theme'>
+        <option value='solid' %THEMESOLID%>Solid</option>
+        <option value='digits' %THEMEDIGITS%>Color per digit</option>
+        <option value='gradient' %THEMEGRADIENT%>Gradient</option>
+      </select>
+      <label>Digit colors (theme per digit, e.g. #FF0000,#FF8800,#00FF00,#0088FF)</label><input name='digitColors' value='%DIGITCOLORS%'>
+      <label>Gradient end color</label><input type='color' name='gradientColor' value='%GRADIENTCOLOR%'>
+      <label>Dot color (empty = theme)</label><input name='dotColor' placeholder='#FFFFFF' value='%DOTCOLOR%'>
+      <label><input type='checkbox' name='nightShift' %NIGHTSHIFT%> Warm colors at night</label>
+      <label>Night color</label><input type='color' name='nightColor' value='%NIGHTCOLOR%'>
+      <label>Night from / to (hour)</label><input name='nightStart' type='number' min='0' max='23' value='%NIGHTSTART%'><input name='nightEnd' type='number' min='0' max='23' value='%NIGHTEND%'>
+      <label>Night fade (minutes)</label><input name='nightFade' type='number' min='0' max='240' value='%NIGHTFADE%'>
+      <label>White point hour / minute strip</label><input type='color' name='hourWhite' value='%HOURWHITE%'><input type='color' name='minuteWhite' value='%MINUTEWHITE%'>
+      <label>Gamma (1.0 = off)</label><input name='gamma' type='number' min='1' max='3' step='0.1' value='%GAMMA%'>
       <label><input type='checkbox' name='blinkDots' %BLINKDOTS%> Blink Dots</label>
       <label><input type='checkbox' name='use24h' %USE24H%> 24h Format</label>
       <label><input type='checkbox' name='hideLeadingZero24h' %HIDEZERO24H%> Hide leading zero (24h)</label>
@@ -214,20 +3275,49 @@ void setupWeb() {
       <label>Dim End Hour</label><input name='dimEnd' type='number' min='0' max='23' value='%DIMEND%'>
       <button type='submit'>Save</button></form>
       <form method='POST' action='/reboot'><button>Reboot</button></form>
-      <br><form method="POST" action="/update" enctype="multipart/form-data">
-      <input type="file" name="update">
-      <button>Upload OTA</button>
-      </form>
+      %OTAFORM%
       <div id="msg"></div>
       <script>
       document.querySelector("form").onsubmit=function(e){document.getElementById('msg').innerText="Saved.";};
       </script>
-      <div class='footer'>7sClock ESP8266</div></body></html>
-    )rawliteral";
+      <div class='footer'>7sClock ESP8266 &middot; <a href='/static/status.html' style='color:#0af'>Status</a></div></body></html>
+    )rawliteral");
 
+#if FEATURE_WEB_OTA
+    html.replace("%OTAFORM%", F(R"rawliteral(<br><form method="POST" action="/update" enctype="multipart/form-data">
+      <input type="file" name="update">
+      <button>Upload OTA</button>
+      </form>
+      <form method="POST" action="/update?target=fs" enctype="multipart/form-data">
+      <input type="file" name="filesystem">
+      <button>Upload filesystem image</button>
+      </form>)rawliteral"));
+#else
+    html.replace("%OTAFORM%", "");
+#endif
+#if FEATURE_FLEET
+    html.replace("%FLEETOPTION%", String("<label><input type='checkbox' name='fleet' ") + (config.fleet ? "checked" : "") +
+                 "> Fleet view of the other clocks (<a href='/fleet' style='color:#0af'>open</a>)</label>");
+#else
+    html.replace("%FLEETOPTION%", "");
+#endif
     html.replace("%NTPSERVER%", config.ntpServer);
     html.replace("%BRIGHTNESS%", String(config.brightness));
     html.replace("%COLOR%", config.segmentColor);
+    html.replace("%THEMESOLID%", config.theme == "solid" ? "selected" : "");
+    html.replace("%THEMEDIGITS%", config.theme == "digits" ? "selected" : "");
+    html.replace("%THEMEGRADIENT%", config.theme == "gradient" ? "selected" : "");
+    html.replace("%DIGITCOLORS%", config.digitColors);
+    html.replace("%GRADIENTCOLOR%", config.gradientColor);
+    html.replace("%DOTCOLOR%", config.dotColor);
+    html.replace("%NIGHTSHIFT%", config.nightShift ? "checked" : "");
+    html.replace("%NIGHTCOLOR%", config.nightColor);
+    html.replace("%NIGHTSTART%", String(config.nightStart));
+    html.replace("%NIGHTEND%", String(config.nightEnd));
+    html.replace("%NIGHTFADE%", String(config.nightFade));
+    html.replace("%HOURWHITE%", config.hourWhite);
+    html.replace("%MINUTEWHITE%", config.minuteWhite);
+    html.replace("%GAMMA%", String(config.gamma, 1));
     html.replace("%BLINKDOTS%", config.blinkDots ? "checked" : "");
     html.replace("%USE24H%", config.use24h ? "checked" : "");
     html.replace("%HIDEZERO24H%", config.hideLeadingZero24h ? "checked" : "");
@@ -235,6 +3325,12 @@ void setupWeb() {
     html.replace("%DIMSTART%", String(config.dimStartHour));
     html.replace("%DIMEND%", String(config.dimEndHour));
     html.replace("%NTPSYNC%", String(config.ntpSyncInterval));
+    html.replace("%NTPSERVERMODE%", config.ntpServerMode ? "checked" : "");
+    html.replace("%TIMEFALLBACK%", config.timeFallbackUrl);
+    html.replace("%LEAPSMEAR%", String(config.leapSmearHours));
+    html.replace("%SYSLOGHOST%", config.syslogHost);
+    html.replace("%SYSLOGPORT%", String(config.syslogPort));
+    html.replace("%WIFIROAMRSSI%", String(config.wifiRoamRssi));
     html.replace("%SEL_EUROPE_BERLIN%", config.timezone == "CET-1CEST,M3.5.0,M10.5.0/3" ? "selected" : "");
     html.replace("%SEL_EUROPE_LONDON%", config.timezone == "GMT0BST,M3.5.0/1,M10.5.0" ? "selected" : "");
     html.replace("%SEL_NY%", config.timezone == "EST5EDT,M3.2.0/2,M11.1.0" ? "selected" : "");
@@ -247,22 +3343,34 @@ void setupWeb() {
     html.replace("%SEL_HONGKONG%", config.timezone == "HKT-8" ? "selected" : "");
     request->send(200, "text/html", html);
   });
+#else
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/plain", "7sClock ESP8266 (minimal build)\nPOST /save to configure, /reboot to restart\n");
+  });
+#endif
 
+  // Every field goes through setConfigField() like /api/batch; nothing is
+  // saved unless all of them are valid. Unticked checkboxes are not sent.
   server.on("/save", HTTP_POST, [](AsyncWebServerRequest *request) {
-    if (request->hasParam("timezone", true)) config.timezone = request->getParam("timezone", true)->value();
-    if (request->hasParam("ntpServer", true)) config.ntpServer = request->getParam("ntpServer", true)->value();
-    if (request->hasParam("brightness", true)) config.brightness = request->getParam("brightness", true)->value().toInt();
-    if (request->hasParam("color", true)) config.segmentColor = request->getParam("color", true)->value();
-    config.blinkDots = request->hasParam("blinkDots", true);
-    config.use24h = request->hasParam("use24h", true);
-    config.hideLeadingZero24h = request->hasParam("hideLeadingZero24h", true);
-    config.autoDim = request->hasParam("autoDim", true);
-    if (request->hasParam("dimStart", true)) config.dimStartHour = request->getParam("dimStart", true)->value().toInt();
-    if (request->hasParam("dimEnd", true)) config.dimEndHour = request->getParam("dimEnd", true)->value().toInt();
-    if (request->hasParam("ntpSyncInterval", true)) config.ntpSyncInterval = request->getParam("ntpSyncInterval", true)->value().toInt();
-    saveConfig();
-    setupTime();
-    String html = R"rawliteral(
+    ClockConfig next = config;
+    for (const char *key : {"timezone", "ntpServer", "timeFallbackUrl", "ntpSyncInterval", "leapSmearHours", "syslogHost", "syslogPort",
+                            "wifiRoamRssi", "brightness", "color", "theme", "digitColors", "gradientColor", "dotColor", "nightColor",
+                            "nightStart", "nightEnd", "nightFade", "hourWhite", "minuteWhite", "gamma", "dimStart", "dimEnd"}) {
+      if (request->hasParam(key, true) && !setConfigField(next, key, request->getParam(key, true)->value())) {
+        request->send(400, "text/plain", String("Invalid ") + key);
+        return;
+      }
+    }
+    for (const char *key : {"nightShift", "blinkDots", "use24h", "hideLeadingZero24h", "autoDim", "ntpServerMode"}) {
+      setConfigField(next, key, request->hasParam(key, true) ? "true" : "false");
+    }
+#if FEATURE_FLEET
+    next.fleet = request->hasParam("fleet", true);
+#endif
+    config = next;
+    configCommit(CONFIG_TIME);
+#if FEATURE_WEB_UI
+    String html = F(R"rawliteral(
       <!DOCTYPE html>
       <html><head><meta name='viewport' content='width=device-width, initial-scale=1'>
       <meta http-equiv='refresh' content='2;url=/'><style>
@@ -273,13 +3381,16 @@ void setupWeb() {
       button { background: #0af; color: white; font-weight: bold; }
       label { display: block; margin-top: 1em; font-weight: bold; }
       .footer { margin-top: 2em; text-align: center; font-size: 0.9em; color: #888; }
-      </style><title>7 Segment Clock save</title></head><body><h1>Saved! setup time...</h1></body><html>)rawliteral";
+      </style><title>7 Segment Clock save</title></head><body><h1>Saved! setup time...</h1></body><html>)rawliteral");
     request->send(200, "text/html", html);
-    delay(1000);
+#else
+    request->send(200, "text/plain", "Saved\n");
+#endif
   });
 
   server.on("/reboot", HTTP_POST, [](AsyncWebServerRequest *request) {
-    String html = R"rawliteral(
+#if FEATURE_WEB_UI
+    String html = F(R"rawliteral(
       <!DOCTYPE html>
       <html><head><meta name='viewport' content='width=device-width, initial-scale=1'>
       <meta http-equiv='refresh' content='2;url=/'><style>
@@ -290,14 +3401,285 @@ void setupWeb() {
       button { background: #0af; color: white; font-weight: bold; }
       label { display: block; margin-top: 1em; font-weight: bold; }
       .footer { margin-top: 2em; text-align: center; font-size: 0.9em; color: #888; }
-      </style><title>7 Segment Clock restart</title></head><body><h1>Rebooting...</h1></body><html>)rawliteral";
+      </style><title>7 Segment Clock restart</title></head><body><h1>Rebooting...</h1></body><html>)rawliteral");
     request->send(200, "text/html", html);
-    delay(1000);
-    ESP.restart();
+#else
+    request->send(200, "text/plain", "Rebooting\n");
+#endif
+    requestRestart();
+  });
+
+  logSocket.onEvent(onLogSocketEvent);
+  server.addHandler(&logSocket);
+  server.addHandler(&busStream);
+
+  for (const ApiRoute &route : apiRoutes) {
+    server.on(route.path, HTTP_GET, [&route](AsyncWebServerRequest *request) {
+      AsyncWebServerResponse *response = request->beginResponse(200, "application/json", route.get());
+      if (route.download) response->addHeader("Content-Disposition", String("attachment; filename=") + route.download);
+      request->send(response);
+    });
+  }
+
+  // Both segments back to back, older first
+  server.on("/api/drift", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!driftLogSeq) {
+      request->send(404, "text/plain", "No drift history yet");
+      return;
+    }
+    uint8_t older = driftSegment ^ 1;
+    size_t olderLen = driftSegmentCount[older] * sizeof(DriftRecord);
+    size_t total = olderLen + driftSegmentCount[driftSegment] * sizeof(DriftRecord);
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", total,
+        [older, olderLen](uint8_t *buf, size_t maxLen, size_t index) -> size_t {
+      uint8_t seg = index < olderLen ? older : older ^ 1;
+      File f = LittleFS.open(driftPath(seg), "r");
+      if (!f) return 0;
+      size_t pos = seg == older ? index : index - olderLen;
+      if (seg == older) maxLen = min(maxLen, olderLen - index);
+      f.seek(pos);
+      size_t n = f.read(buf, maxLen);
+      f.close();
+      return n;
+    });
+    response->addHeader("Content-Disposition", "attachment; filename=\"drift.bin\"");
+    request->send(response);
+  });
+
+  server.on("/api/events", HTTP_GET, [](AsyncWebServerRequest *request) {
+    long before = 0;
+    if (request->hasParam("before") && !parseRange(request->getParam("before")->value(), 1, INT32_MAX, before)) {
+      request->send(400, "text/plain", "before must be a positive integer");
+      return;
+    }
+    auto st = std::make_shared<EventStream>();
+    st->oldest = eventOldestSeq();
+    st->next = eventSeq;
+    st->remaining = 50;
+    if (before) st->next = min((uint32_t)before - 1, eventSeq);
+    if (request->hasParam("limit")) st->remaining = constrain(request->getParam("limit")->value().toInt(), 1, EVENT_PAGE_MAX);
+    request->send(request->beginChunkedResponse("application/json", [st](uint8_t *buf, size_t maxLen, size_t) -> size_t {
+      size_t out = 0;
+      while (out < maxLen) {
+        if (st->pos == st->len) {
+          if (st->stage == 3) break;
+          eventStreamFill(*st);
+          continue;
+        }
+        size_t n = min(st->len - st->pos, maxLen - out);
+        memcpy(buf + out, st->buf + st->pos, n);
+        st->pos += n;
+        out += n;
+      }
+      return out;
+    }));
+  });
+
+  server.on("/api/batch", HTTP_POST, [](AsyncWebServerRequest *request) {
+    JsonDocument reply;
+    int status;
+    if (!request->contentLength()) {
+      status = 400;
+      reply["error"] = "missing body";
+    } else if (!request->_tempObject) {
+      status = 413;
+      reply["error"] = "body too large";
+    } else {
+      status = runBatch((const char *)request->_tempObject, reply);
+    }
+    String out;
+    serializeJson(reply, out);
+    request->send(status, "application/json", out);
+  }, NULL, collectBody);
+
+  server.on("/api/config", HTTP_POST, [](AsyncWebServerRequest *request) {
+    JsonDocument reply;
+    int status = 413;
+    if (!request->_tempObject) reply["error"] = "missing or too large body";
+    else status = restoreConfig((const char *)request->_tempObject, reply);
+    String out;
+    serializeJson(reply, out);
+    request->send(status, "application/json", out);
+  }, NULL, collectBody);
+
+  // Takes any of the theme and night shift fields as query or form
+  // parameters; nothing is applied unless all of them are valid
+  server.on("/api/theme", HTTP_POST, [](AsyncWebServerRequest *request) {
+    ClockConfig next = config;
+    for (const char *key : {"color", "theme", "digitColors", "gradientColor", "dotColor",
+                            "nightShift", "nightColor", "nightStart", "nightEnd", "nightFade",
+                            "hourWhite", "minuteWhite", "gamma"}) {
+      const AsyncWebParameter *p = request->hasParam(key, true) ? request->getParam(key, true) : request->getParam(key);
+      if (p && !setConfigField(next, key, p->value())) {
+        request->send(400, "text/plain", String("Invalid ") + key);
+        return;
+      }
+    }
+    config = next;
+    configCommit(0);
+    // The LED colors are recompiled when the bus delivers the change
+    request->send(200, "application/json", "{\"generation\":" + String(configGeneration) + "}");
+  });
+
+#if FEATURE_WEB_UI
+  server.on("/setup", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/html", F(R"rawliteral(
+      <!DOCTYPE html>
+      <html><head><meta name='viewport' content='width=device-width, initial-scale=1'><style>
+      body { font-family: sans-serif; background: #111; color: #fff; padding: 1em; }
+      input, button { width: 100%; padding: 0.5em; margin: 0.5em 0; border-radius: 5px; border: none; }
+      input { background: #222; color: #fff; }
+      button { background: #0af; color: white; font-weight: bold; }
+      </style><title>7 Segment Clock setup</title></head><body><h1>WiFi setup</h1>
+      <form method='POST' action='/api/provision'>
+      <input name='ssid' placeholder='Network name'><input name='pass' type='password' placeholder='Password'>
+      <button type='submit'>Connect</button></form>
+      <p>Progress: <a href='/api/provision'>/api/provision</a></p></body></html>)rawliteral"));
+  });
+#endif
+
+  // Credentials as JSON, {"ssid": "...", "pass": "..."} or an array of such
+  // objects, or as ssid/pass form parameters from the /setup page. Only
+  // accepted while provisioning; afterwards /api/wifi/networks is the way.
+  server.on("/api/provision", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (provision.state == PROV_OFF) {
+      request->send(409, "text/plain", "Not provisioning, use /api/wifi/networks");
+      return;
+    }
+    JsonDocument doc;
+    if (request->hasParam("ssid", true)) {
+      doc["ssid"] = request->getParam("ssid", true)->value();
+      if (request->hasParam("pass", true)) doc["pass"] = request->getParam("pass", true)->value();
+    } else if (!request->_tempObject || deserializeJson(doc, (const char *)request->_tempObject)) {
+      request->send(400, "text/plain", "Body must be JSON credentials");
+      return;
+    }
+    if (doc.is<JsonObjectConst>()) {
+      JsonDocument one;
+      one.add(doc.as<JsonObjectConst>());
+      doc = one;
+    }
+    uint8_t added = 0;
+    for (JsonVariantConst n : doc.as<JsonArrayConst>()) {
+      if (!provisionNetwork(n["ssid"] | "", n["pass"] | "")) {
+        request->send(400, "text/plain", "Invalid network or list full");
+        return;
+      }
+      added++;
+    }
+    if (!added) {
+      request->send(400, "text/plain", "No network given");
+      return;
+    }
+    request->send(202, "application/json", provisionJson());
+  }, NULL, collectBody);
+
+#if FEATURE_FLEET
+#if FEATURE_WEB_UI
+  server.on("/fleet", HTTP_GET, [](AsyncWebServerRequest *request) {
+    request->send(200, "text/html", F(R"rawliteral(
+      <!DOCTYPE html>
+      <html><head><meta name='viewport' content='width=device-width, initial-scale=1'><style>
+      body { font-family: sans-serif; background: #111; color: #fff; padding: 1em; }
+      h1 { text-align: center; }
+      table { width: 100%; border-collapse: collapse; }
+      th, td { padding: 0.4em; text-align: left; border-bottom: 1px solid #333; }
+      a { color: #0af; }
+      .stale { color: #888; }
+      .footer { margin-top: 2em; text-align: center; font-size: 0.9em; color: #888; }
+      </style><title>7 Segment Clock fleet</title></head><body><h1>Fleet</h1>
+      <table><thead><tr><th>Clock</th><th>Time</th><th>Offset</th><th>WiFi</th><th>Uptime</th><th>Heap</th><th>Checked</th></tr></thead>
+      <tbody id='rows'></tbody></table>
+      <p id='note'></p>
+      <div class='footer'><a href='/'>Settings</a></div>
+      <script>
+      function row(s, peer) {
+        var tr = document.createElement('tr');
+        if (peer && !peer.ok) tr.className = 'stale';
+        var cells = [
+          "<a href='http://" + (s ? s.ip : peer.ip) + "/'>" + (s ? s.name : peer.host) + "</a>",
+          s ? (s.synced ? s.source + ' / ' + s.stratum : 'not synced') : '-',
+          s ? (s.offsetUs / 1000).toFixed(1) + ' ms' : '-',
+          s ? s.ssid + ' ' + s.rssi + ' dBm' : '-',
+          s ? Math.floor(s.uptimeS / 3600) + ' h' : '-',
+          s ? s.freeHeap : '-',
+          peer ? (peer.pending ? 'querying' : peer.ageMs != null ? Math.round(peer.ageMs / 1000) + ' s ago' : '-') : 'this clock'];
+        tr.innerHTML = cells.map(function(c) { return '<td>' + c + '</td>'; }).join('');
+        return tr;
+      }
+      function load() {
+        fetch('/api/fleet').then(function(r) { return r.json(); }).then(function(f) {
+          var rows = document.getElementById('rows');
+          rows.innerHTML = '';
+          rows.appendChild(row(f.self, null));
+          f.peers.forEach(function(p) { rows.appendChild(row(p.status, p)); });
+          document.getElementById('note').innerText = f.enabled ? f.peers.length + ' peers, answers cached ' + f.ttlMs / 1000 + ' s'
+            : 'Fleet view is off; enable it in the settings.';
+        });
+      }
+      load();
+      setInterval(load, 10000);
+      </script></body></html>)rawliteral"));
+  });
+#endif
+#endif
+
+  // Known networks: POST adds one or changes its password, DELETE forgets
+  // it; ssid and pass come as query or form parameters
+  server.on("/api/wifi/networks", HTTP_POST, [](AsyncWebServerRequest *request) {
+    const AsyncWebParameter *ssid = request->hasParam("ssid", true) ? request->getParam("ssid", true) : request->getParam("ssid");
+    const AsyncWebParameter *pass = request->hasParam("pass", true) ? request->getParam("pass", true) : request->getParam("pass");
+    if (!ssid || !wifiAddNetwork(ssid->value(), pass ? pass->value() : String())) {
+      request->send(400, "text/plain", "Invalid network or list full");
+      return;
+    }
+    request->send(200, "application/json", wifiJson());
+  });
+
+  server.on("/api/wifi/networks", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    if (!request->hasParam("ssid") || !wifiRemoveNetwork(request->getParam("ssid")->value())) {
+      request->send(404, "text/plain", "Unknown network");
+      return;
+    }
+    request->send(200, "application/json", wifiJson());
+  });
+
+  // The raw program is collected by the body callback and loaded once complete
+  server.on("/api/effect", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (effectUploadLen > sizeof(effectUpload)) {
+      request->send(413, "text/plain", "Effect too large");
+    } else if (!effectLoad(effectUpload, effectUploadLen)) {
+      request->send(400, "text/plain", "Invalid effect program");
+    } else {
+      effectSaveFile();
+      LOG(LOG_INFO, "Effect uploaded: %u bytes, %u ms frames", effect.codeLen, effect.frameMs);
+      request->send(200, "text/plain", "Effect loaded\n");
+    }
+    effectUploadLen = 0;
+  }, NULL, [](AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    effectUploadLen = total;
+    if (total > sizeof(effectUpload)) return;
+    memcpy(effectUpload + index, data, len);
+  });
+
+  server.on("/api/effect", HTTP_DELETE, [](AsyncWebServerRequest *request) {
+    effect.loaded = false;
+    LittleFS.remove(EFFECT_PATH);
+    request->send(200, "text/plain", "Effect removed\n");
+  });
+
+  // Benchmarks block the loop, so they are only scheduled here and run from loop()
+  server.on("/api/bench", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (request->hasParam("frames")) benchRequest.frames = constrain(request->getParam("frames")->value().toInt(), 1, 2000);
+    if (request->hasParam("fsload")) benchRequest.fsLoad = request->getParam("fsload")->value().toInt() != 0;
+    benchRequest.pending = true;
+    request->send(202, "application/json", benchJson());
   });
 
+#if FEATURE_WEB_OTA
   server.on("/update", HTTP_POST, [](AsyncWebServerRequest *request){
-    String html = R"rawliteral(
+#if FEATURE_WEB_UI
+    String html = F(R"rawliteral(
       <!DOCTYPE html>
       <html><head><meta name='viewport' content='width=device-width, initial-scale=1'>
       <meta http-equiv='refresh' content='5;url=/'><style>
@@ -308,20 +3690,55 @@ void setupWeb() {
       button { background: #0af; color: white; font-weight: bold; }
       label { display: block; margin-top: 1em; font-weight: bold; }
       .footer { margin-top: 2em; text-align: center; font-size: 0.9em; color: #888; }
-      </style><title>7 Segment Clock update</title></head><body><h1>Update complete. Rebooting...</h1></body><html>)rawliteral";
+      </style><title>7 Segment Clock update</title></head><body><h1>Update complete. Rebooting...</h1></body><html>)rawliteral");
+    if (Update.hasError()) {
+      request->send(500, "text/plain", "Update failed: " + Update.getErrorString() + "\n");
+      return;
+    }
     request->send(200, "text/html", html);
-    delay(1000);
-    ESP.restart();
+#else
+    if (Update.hasError()) {
+      request->send(500, "text/plain", "Update failed: " + Update.getErrorString() + "\n");
+      return;
+    }
+    request->send(200, "text/plain", "Update complete. Rebooting\n");
+#endif
+    requestRestart();
   }, [](AsyncWebServerRequest *request, String filename, size_t index, uint8_t *data, size_t len, bool final) {
+    // ?target=fs takes a LittleFS image of data/ instead of firmware;
+    // ?md5= has the updater verify the image before accepting it
+    bool fs = request->hasParam("target") && request->getParam("target")->value() == "fs";
+    static int8_t lastPercent = 0;
     if (!index) {
-      Update.begin((ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000);
+      lastPercent = 0;
+      busPublish(BUS_OTA_PROGRESS, OTA_PHASE_START, fs ? 1 : 0);
+      if (fs) {
+        fsImageBegin();
+        Update.begin((size_t)&_FS_end - (size_t)&_FS_start, U_FS);
+      } else {
+        Update.begin((ESP.getFreeSketchSpace() - 0x1000) & 0xFFFFF000);
+      }
+      if (request->hasParam("md5")) Update.setMD5(request->getParam("md5")->value().c_str());
+    }
+    if (!Update.hasError()) Update.write(data, len);
+    int8_t percent = request->contentLength() ? (uint64_t)(index + len) * 100 / request->contentLength() : 0;
+    if (percent >= lastPercent + 10) {
+      lastPercent = percent;
+      busPublish(BUS_OTA_PROGRESS, OTA_PHASE_PROGRESS, percent);
     }
-    Update.write(data, len);
     if (final) {
-      Update.end(true);
+      if (Update.end(true)) {
+        busPublish(BUS_OTA_PROGRESS, OTA_PHASE_END);
+      } else {
+        busPublish(BUS_OTA_PROGRESS, OTA_PHASE_FAIL, Update.getError());
+        LOG(LOG_ERROR, "OTA Error [%u]: %s", Update.getError(), Update.getErrorString().c_str());
+      }
+      if (fs) fsImageInstalled();
     }
   });
+#endif
 
+#if FEATURE_SSDP
   server.on("/description.xml", HTTP_GET, [](AsyncWebServerRequest *request) {
     String chipId = String(ESP.getChipId(), DEC);
     String xml = "<?xml version=\"1.0\"?>\n";
@@ -338,6 +3755,7 @@ void setupWeb() {
     xml += "    <modelURL>https://github.com/Gabbajoe/7sClock</modelURL>\n";
     xml += "    <serialNumber>" + chipId + "</serialNumber>\n";
     xml += "    <UDN>uuid:7sclock-" + chipId + "</UDN>\n";
+#if FEATURE_UPNP
     xml += "    <serviceList>\n";
     xml += "        <service>\n";
     xml += "          <serviceType>urn:schemas-upnp-org:service:ClockControl:1</serviceType>\n";
@@ -347,13 +3765,16 @@ void setupWeb() {
     xml += "          <SCPDURL>/upnp/service-desc.xml</SCPDURL>\n";
     xml += "      </service>\n";
     xml += "    </serviceList>\n";
+#endif
     xml += "  </device>\n";
     xml += "</root>\n";         
     request->send(200, "text/xml", xml);
   });
+#endif
 
+#if FEATURE_UPNP
   server.on("/upnp/service-desc.xml", HTTP_GET, [](AsyncWebServerRequest *request) {
-    String xml = R"rawliteral(<?xml version="1.0"?>
+    String xml = F(R"rawliteral(<?xml version="1.0"?>
 <scpd xmlns="urn:schemas-upnp-org:service-1-0">
   <specVersion>
     <major>1</major>
@@ -389,6 +3810,16 @@ void setupWeb() {
     <action>
       <name>ToggleDotBlinking</name>
     </action>
+    <action>
+      <name>SetTheme</name>
+      <argumentList>
+        <argument>
+          <name>Theme</name>
+          <direction>in</direction>
+          <relatedStateVariable>Theme</relatedStateVariable>
+        </argument>
+      </argumentList>
+    </action>
   </actionList>
   <serviceStateTable>
     <stateVariable sendEvents="no">
@@ -399,9 +3830,18 @@ void setupWeb() {
       <name>Brightness</name>
       <dataType>ui1</dataType>
     </stateVariable>
+    <stateVariable sendEvents="no">
+      <name>Theme</name>
+      <dataType>string</dataType>
+      <allowedValueList>
+        <allowedValue>solid</allowedValue>
+        <allowedValue>digits</allowedValue>
+        <allowedValue>gradient</allowedValue>
+      </allowedValueList>
+    </stateVariable>
   </serviceStateTable>
 </scpd>
-)rawliteral";
+)rawliteral");
     request->send(200, "text/xml", xml);
   });
 
@@ -417,25 +3857,25 @@ void setupWeb() {
 
     String action = request->header("SOAPACTION");
     action.replace("\"", "");
-    Serial.println("SOAP Action: " + action);
-    Serial.println("Body:\n" + body);
+    LOG(LOG_INFO, "SOAP action: %s", action.c_str());
+    LOG(LOG_DEBUG, "SOAP body:\n%s", body.c_str());
     if (action.endsWith("#ToggleDotBlinking")) {
       config.blinkDots = !config.blinkDots;
-      saveConfig();
+      configCommit(0);
       sendSoapResponse(request, "ToggleDotBlinking");
     } else if (action.endsWith("#Toggle24hFormat")) {
       config.use24h = !config.use24h;
-      saveConfig();
+      configCommit(0);
       sendSoapResponse(request, "Toggle24hFormat");
     } else if (action.endsWith("#ToggleLeadingZero")) {
       config.hideLeadingZero24h = !config.hideLeadingZero24h;
-      saveConfig();
+      configCommit(0);
       sendSoapResponse(request, "ToggleLeadingZero");
     } else if (action.endsWith("#SetColor")) {
       String hex = extractTag(body, "Hex");
       if (hex.length() == 6 || (hex.startsWith("#") && hex.length() == 7)) {
         config.segmentColor = hex.startsWith("#") ? hex : ("#" + hex);
-        saveConfig();
+        configCommit(0);
         sendSoapResponse(request, "SetColor");
       } else {
         request->send(400, "text/plain", "Invalid color format");
@@ -444,63 +3884,284 @@ void setupWeb() {
     } else if (action.endsWith("#SetBrightness")) {
       int brightness = extractIntFromTag(body, "Value");
       config.brightness = constrain(brightness, 0, 255);
-      saveConfig();
+      configCommit(0);
       sendSoapResponse(request, "SetBrightness");
+    } else if (action.endsWith("#SetTheme")) {
+      if (setConfigField(config, "theme", extractTag(body, "Theme"))) {
+        configCommit(0);
+        sendSoapResponse(request, "SetTheme");
+      } else {
+        request->send(400, "text/plain", "Invalid theme");
+      }
     } else {
       request->send(500, "text/plain", "Unknown action");
     }
   });
+#endif
+  // Assets from the filesystem image (data/www), updatable without new firmware
+  server.onNotFound([](AsyncWebServerRequest *request) {
+    // Phones probe random URLs to find a captive portal; send them to the form
+    if (provision.state != PROV_OFF) {
+      request->redirect("http://" + WiFi.softAPIP().toString() + "/setup");
+      return;
+    }
+    request->send(404, "text/plain", "Not found");
+  });
+
+  server.serveStatic("/static/", LittleFS, "/www/").setCacheControl("max-age=600");
+
   server.begin();
 }
 
+// Serial console input: collected a few bytes per loop() pass and run as
+// a command on newline.
+#define CONSOLE_LINE_MAX   96
+#define CONSOLE_RX_BUDGET  32
+
+char consoleLine[CONSOLE_LINE_MAX];
+size_t consoleLineLen = 0;
+bool consoleLineOverflow = false;
+
+// Prints the newest drift history records, newest first
+void consoleTrace(int count) {
+  if (driftLogSeq == 0) {
+    consolePrint("no sync history\r\n");
+    return;
+  }
+  consolePrint("seq unix offsetUs delayUs driftPpb src\r\n");
+  DriftRecord r;
+  for (uint32_t seq = driftLogSeq; seq > 0 && count > 0 && driftLogRead(seq, r); seq--, count--) {
+    consolePrintf("%u %u %ld %u %ld %u\r\n", r.seq, r.unixTime, (long)r.offsetUs, r.delayUs, (long)r.driftPpb, r.source);
+  }
+}
+
+void consoleRun(char *line) {
+  char *cmd = strtok(line, " ");
+  if (!cmd) return;
+  char *arg1 = strtok(nullptr, " ");
+  char *arg2 = strtok(nullptr, "");
+  if (!strcmp(cmd, "help")) {
+    consolePrint("help | metrics | config | trace [n] | set <key> <value> | sync | bench [frames] [fsload] | log <level> | reboot\r\n");
+  } else if (!strcmp(cmd, "metrics")) {
+    consolePrint(metricsJson() + "\r\n");
+  } else if (!strcmp(cmd, "config")) {
+    JsonDocument doc;
+    configToJson(config, doc.to<JsonObject>());
+    String out;
+    serializeJson(doc, out);
+    consolePrint(out + "\r\n");
+  } else if (!strcmp(cmd, "trace")) {
+    consoleTrace(arg1 ? constrain(atoi(arg1), 1, 32) : 8);
+  } else if (!strcmp(cmd, "set")) {
+    if (!arg1 || !setConfigField(config, arg1, arg2 ? arg2 : "")) {
+      consolePrint("invalid key or value\r\n");
+      return;
+    }
+    configCommit(CONFIG_TIME);
+    consolePrint("ok\r\n");
+  } else if (!strcmp(cmd, "sync")) {
+    ntpRequest();
+    consolePrint("sync requested\r\n");
+  } else if (!strcmp(cmd, "bench")) {
+    runFrameBenchmark(arg1 ? constrain(atoi(arg1), 1, 2000) : 200, arg2 ? atoi(arg2) != 0 : true);
+    consolePrint(benchJson() + "\r\n");
+  } else if (!strcmp(cmd, "log")) {
+    int level = arg1 ? parseLogLevel(arg1) : -1;
+    if (level < 0) {
+      consolePrint("usage: log error|warn|info|debug\r\n");
+      return;
+    }
+    serialLogLevel = level;
+    logUpdateMaxLevel();
+    consolePrint("ok\r\n");
+  } else if (!strcmp(cmd, "reboot")) {
+    consolePrint("rebooting\r\n");
+    requestRestart();
+  } else {
+    consolePrintf("unknown command '%s', try help\r\n", cmd);
+  }
+}
+
+void consolePoll() {
+  for (int budget = CONSOLE_RX_BUDGET; budget > 0 && Serial.available() > 0; budget--) {
+    char c = Serial.read();
+    if (c == '\r' || c == '\n') {
+      if (consoleLineOverflow) {
+        consolePrint("line too long\r\n");
+      } else if (consoleLineLen) {
+        consoleLine[consoleLineLen] = '\0';
+        consoleRun(consoleLine);
+      }
+      consoleLineLen = 0;
+      consoleLineOverflow = false;
+    } else if (c == '\b' || c == 0x7F) {
+      if (consoleLineLen) consoleLineLen--;
+    } else if (consoleLineLen < CONSOLE_LINE_MAX - 1) {
+      consoleLine[consoleLineLen++] = c;
+    } else {
+      consoleLineOverflow = true;
+    }
+  }
+  consoleFlush();
+}
+
+// Bus subscribers. Persistence, renderer and time setup react to config
+// changes; the event log, the log sinks (serial, WebSocket, syslog) and
+// the SSE stream record what happened.
+void busSaveConfig(const BusEvent &) {
+  saveConfig();
+}
+
+void busRender(const BusEvent &e) {
+  if (e.topic == BUS_CONFIG_CHANGED) applyConfig();
+  updateDisplay();
+}
+
+void busSetupTime(const BusEvent &e) {
+  if (e.a & CONFIG_TIME) setupTime();
+}
+
+void busEventLog(const BusEvent &e) {
+  if (e.topic == BUS_CONFIG_CHANGED) eventLog(EV_CONFIG_SAVED, e.b);
+  else if (e.topic == BUS_WIFI_STATE) eventLog(e.a ? EV_WIFI_UP : EV_WIFI_DOWN, e.b);
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_START) eventLog(EV_OTA_START, e.b);
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_END) eventLog(EV_OTA_END);
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_FAIL) eventLog(EV_OTA_FAIL, e.b);
+}
+
+void busLog(const BusEvent &e) {
+  if (e.topic == BUS_CONFIG_CHANGED) LOG(LOG_INFO, "Config changed, generation %d", e.b);
+  else if (e.topic == BUS_WIFI_STATE && e.a) LOG(LOG_INFO, "WiFi up, %s", WiFi.localIP().toString().c_str());
+  else if (e.topic == BUS_WIFI_STATE) LOG(LOG_INFO, "WiFi down, reason %d", e.b);
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_START) LOG(LOG_INFO, "Start updating %s", e.b ? "filesystem" : "sketch");
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_PROGRESS) LOG(LOG_DEBUG, "Progress: %d%%", e.b);
+  else if (e.topic == BUS_OTA_PROGRESS && e.a == OTA_PHASE_END) LOG(LOG_INFO, "Update complete");
+}
+
+void busSse(const BusEvent &e) {
+  if (!busStream.count()) return;
+  static const char *const otaPhases[] = { "start", "progress", "end", "fail" };
+  char data[96];
+  if (e.topic == BUS_CONFIG_CHANGED) {
+    snprintf(data, sizeof(data), "{\"generation\":%d,\"time\":%s}", e.b, e.a & CONFIG_TIME ? "true" : "false");
+  } else if (e.topic == BUS_TIME_SYNCED) {
+    snprintf(data, sizeof(data), "{\"offsetUs\":%d,\"source\":\"%s\"}", e.a, e.b == TIME_SRC_NTP ? "ntp" : "http");
+  } else if (e.topic == BUS_WIFI_STATE) {
+    snprintf(data, sizeof(data), "{\"up\":%s,\"reason\":%d}", e.a ? "true" : "false", e.b);
+  } else {
+    snprintf(data, sizeof(data), "{\"phase\":\"%s\",\"value\":%d}", otaPhases[e.a & 3], e.b);
+  }
+  busStream.send(data, busTopicNames[e.topic], busStats.published);
+}
+
+void busSetup() {
+  busSubscribe(BUS_CONFIG_CHANGED, busSaveConfig);
+  busSubscribe(BUS_CONFIG_CHANGED, busRender);
+  busSubscribe(BUS_CONFIG_CHANGED, busSetupTime);
+  busSubscribe(BUS_TIME_SYNCED, busRender);
+  for (uint8_t t = 0; t < BUS_TOPIC_COUNT; t++) {
+    busSubscribe((BusTopic)t, busEventLog);
+    busSubscribe((BusTopic)t, busLog);
+    busSubscribe((BusTopic)t, busSse);
+  }
+}
+
+WiFiEventHandler wifiUpHandler;
+WiFiEventHandler wifiDownHandler;
+
 void setup() {
   Serial.begin(115200);
+  bootProfileBegin();
   LittleFS.begin();
+  bootProfileMark(BOOT_FS);
   loadConfig();
+  busSetup();
+  applyConfig();
+  if (configMigratedFrom >= 0) LOG(LOG_INFO, "Config migrated from schema %d to %d", configMigratedFrom, CONFIG_SCHEMA);
+  driftLogLoad();
+  eventLogLoad();
+  effectLoadFile();
+  eventLog(EV_BOOT, ESP.getResetInfoPtr()->reason);
+  bootProfileMark(BOOT_CONFIG);
 
-  WiFi.hostname("7sclock");
-  AsyncWiFiManager wm(&server, &dns);
-  wm.setTimeout(180);
-  if (!wm.autoConnect("7sClockSetup")) ESP.restart();
+  WiFi.hostname(clockName());
+  wifiUpHandler = WiFi.onStationModeGotIP([](const WiFiEventStationModeGotIP &) { busPublish(BUS_WIFI_STATE, 1); });
+  wifiDownHandler = WiFi.onStationModeDisconnected([](const WiFiEventStationModeDisconnected &e) { busPublish(BUS_WIFI_STATE, 0, e.reason); });
+  wifiLoadNetworks();
+  // Clocks set up by the old captive portal have their network only in the SDK's config
+  if (!wifiNetworkCount && WiFi.SSID().length()) wifiAddNetwork(WiFi.SSID(), WiFi.psk());
+  // wifiPoll() scans and joins from loop(); the SDK must not also rewrite
+  // its stored network on every roam
+  WiFi.persistent(false);
+  if (wifiNetworkCount) WiFi.mode(WIFI_STA);
+  else provisionBegin("No known WiFi network");
+  bootProfileMark(BOOT_WIFI);
 
   // Start mDNS
-  if (MDNS.begin("7sclock")) {
-    Serial.println("mDNS responder started");
+  if (MDNS.begin(clockName())) {
+    // Fleet aggregators find the clocks by this service
+    MDNS.addService("7sclock", "tcp", 80);
+    LOG(LOG_INFO, "mDNS responder started as %s.local", clockName());
   } else {
-    Serial.println("Error setting up mDNS responder!");
+    LOG(LOG_ERROR, "Error setting up mDNS responder!");
   }
+  bootProfileMark(BOOT_MDNS);
 
-  ArduinoOTA.setHostname("7sclock");
+#if FEATURE_ARDUINO_OTA
+  ArduinoOTA.setHostname(clockName());
 
+  // The upload runs inside ArduinoOTA.handle(), so loop() does not come
+  // round until it is over; these callbacks are in loop() context and
+  // deliver their events right away.
   ArduinoOTA.onStart([]() {
-    String type = ArduinoOTA.getCommand() == U_FLASH ? "sketch" : "filesystem";
-    Serial.println("Start updating " + type);
+    busPublish(BUS_OTA_PROGRESS, OTA_PHASE_START, ArduinoOTA.getCommand() == U_FLASH ? 0 : 1);
+    busDispatch();
+    if (ArduinoOTA.getCommand() == U_FS) fsImageBegin();
   });
 
   ArduinoOTA.onEnd([]() {
-    Serial.println("\nUpdate complete");
+    busPublish(BUS_OTA_PROGRESS, OTA_PHASE_END);
+    busDispatch();
+    if (ArduinoOTA.getCommand() == U_FS) fsImageInstalled();
+    else eventFlush();
   });
 
   ArduinoOTA.onProgress([](unsigned int progress, unsigned int total) {
-    Serial.printf("Progress: %u%%\r", (progress * 100) / total);
+    static unsigned lastPercent = 0;
+    unsigned percent = (progress * 100) / total;
+    if (percent < lastPercent) lastPercent = 0;
+    if (percent < lastPercent + 10) return;
+    lastPercent = percent;
+    busPublish(BUS_OTA_PROGRESS, OTA_PHASE_PROGRESS, percent);
+    busDispatch();
   });
 
   ArduinoOTA.onError([](ota_error_t error) {
-    Serial.printf("OTA Error [%u]: ", error);
-    if (error == OTA_AUTH_ERROR) Serial.println("Auth Failed");
-    else if (error == OTA_BEGIN_ERROR) Serial.println("Begin Failed");
-    else if (error == OTA_CONNECT_ERROR) Serial.println("Connect Failed");
-    else if (error == OTA_RECEIVE_ERROR) Serial.println("Receive Failed");
-    else if (error == OTA_END_ERROR) Serial.println("End Failed");
+    const char *reason = "";
+    if (error == OTA_AUTH_ERROR) reason = "Auth Failed";
+    else if (error == OTA_BEGIN_ERROR) reason = "Begin Failed";
+    else if (error == OTA_CONNECT_ERROR) reason = "Connect Failed";
+    else if (error == OTA_RECEIVE_ERROR) reason = "Receive Failed";
+    else if (error == OTA_END_ERROR) reason = "End Failed";
+    busPublish(BUS_OTA_PROGRESS, OTA_PHASE_FAIL, error);
+    busDispatch();
+    LOG(LOG_ERROR, "OTA Error [%u]: %s", error, reason);
   });
 
   ArduinoOTA.begin();
+  bootProfileMark(BOOT_OTA);
+#endif
 
+  dnsUdp.begin(DNSC_LOCAL_PORT);
+  ntpUdp.begin(NTP_PORT);
   setupTime();
+  bootProfileMark(BOOT_TIME);
 
   hourStrip.begin();
   minuteStrip.begin();
+  bootProfileMark(BOOT_STRIPS);
 
+#if FEATURE_SSDP
   // Setup SSDP
   SSDP.setSchemaURL("description.xml");
   SSDP.setHTTPPort(80);
@@ -514,24 +4175,66 @@ void setup() {
   SSDP.setManufacturerURL("https://github.com/Gabbajoe");
   SSDP.setDeviceType("urn:schemas-upnp-org:device:7SegmentClock:1");
   SSDP.begin();
+  bootProfileMark(BOOT_SSDP);
+#endif
 
 
   setupWeb();
+#if FEATURE_KEEPALIVE_API
+  apiServer.onClient(apiAccept, nullptr);
+  apiServer.setNoDelay(true);
+  apiServer.begin();
+#endif
+  bootProfileMark(BOOT_WEB);
 }
 
-unsigned long lastBlink = 0;
-unsigned long lastSync = 0;
+uint64_t lastBlink = 0;
+uint64_t lastSync = 0;
+uint64_t lastEffectFrame = 0;
 
 void loop() {
-  unsigned long now = millis();
-  if (now - lastBlink >= 1000) {
+  uint64_t now = monoUs();
+  busDispatch();
+  if (restartAtUs && now >= restartAtUs) {
+    eventFlush();
+    ESP.restart();
+  }
+  if (now - lastBlink >= SEC_US(1)) {
     dotState = config.blinkDots ? !dotState : true;
     lastBlink = now;
     updateDisplay();
   }
-  if (now - lastSync >= config.ntpSyncInterval * 60 * 1000UL) {
-    setupTime();
+  if (effect.loaded && now - lastEffectFrame >= MS_US(effect.frameMs)) {
+    lastEffectFrame = now;
+    renderFrame(lastFrame);
+  }
+  if (benchRequest.pending) {
+    runFrameBenchmark(benchRequest.frames, benchRequest.fsLoad);
+    benchRequest.pending = false;
+  }
+  if (now - lastSync >= SEC_US(config.ntpSyncInterval * 60 * syncBackoff)) {
+    ntpRequest();
     lastSync = now;
   }
+  consolePoll();
+  logSocket.cleanupClients(LOG_MAX_CLIENTS);
+  wifiPoll(now);
+  provisionPoll(now);
+  MDNS.update();
+#if FEATURE_FLEET
+  fleetPoll(now);
+#endif
+#if FEATURE_KEEPALIVE_API
+  apiPoll(now);
+#endif
+  dnsPoll(now);
+  ntpPoll(now);
+  httpTimePoll(now);
+  syslogPoll();
+  eventPoll(now);
+  timeDriftTick(now);
+  leapTick();
+#if FEATURE_ARDUINO_OTA
   ArduinoOTA.handle();
+#endif
 }
@@ -0,0 +1,54 @@
+/*
+  Calendar, leap smear and time parsing helpers for 7sClock. Plain C++ with no Arduino
+  dependencies, so the native unit tests in test/ can build them on the host.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// Days since 1970-01-01 for a proleptic Gregorian date
+inline int64_t daysFromCivil(int y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = y - era * 400;
+  unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return (int64_t)era * 146097 + doe - 719468;
+}
+
+// Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT")
+inline bool parseHttpDate(const char *s, time_t &out) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  int d, y, hh, mm, ss;
+  char mon[4];
+  if (sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d", &d, mon, &y, &hh, &mm, &ss) != 6) return false;
+  const char *m = strstr(months, mon);
+  if (!m || strlen(mon) != 3) return false;
+  out = daysFromCivil(y, (m - months) / 3 + 1, d) * 86400 + hh * 3600 + mm * 60 + ss;
+  return true;
+}
+
+// Correction for a smear of `sign` seconds ending the day at `at`, as a
+// function of leap-free time tauUs. Zero before the window, the full
+// -sign seconds after it; windowS == 0 gives a plain step at `at`.
+inline int64_t leapSmearUs(int64_t tauUs, time_t at, int8_t sign, uint32_t windowS) {
+  int64_t atUs = (int64_t)at * 1000000;
+  if (windowS == 0) return tauUs >= atUs ? -sign * 1000000LL : 0;
+  int64_t windowUs = (int64_t)windowS * 1000000;
+  int64_t startUs = atUs - windowUs / 2;
+  if (tauUs <= startUs) return 0;
+  if (tauUs >= startUs + windowUs) return -sign * 1000000LL;
+  return -sign * (tauUs - startUs) * 1000000 / windowUs;
+}
+
+// Maps an upstream (unsmeared) POSIX time in microseconds to the time our
+// smeared clock should show at that instant; sign 0 means no leap pending.
+inline int64_t leapTargetUs(int64_t posixUs, time_t at, int8_t sign, uint32_t windowS) {
+  if (!sign) return posixUs;
+  int64_t tau = posixUs;
+  if (posixUs >= (int64_t)at * 1000000) tau += sign * 1000000LL;   // undo the upstream step
+  return tau + leapSmearUs(tau, at, sign, windowS);
+}
@@ -0,0 +1,119 @@
+// Host tests for src/configschema.h: pio test -e native
+#include <string>
+#include <unity.h>
+#include "configschema.h"
+
+void setUp() {}
+void tearDown() {}
+
+std::string serialized(const JsonDocument &doc) {
+  std::string out;
+  serializeJson(doc, out);
+  return out;
+}
+
+// data/config.json relative to this file, so the test runs from any directory
+std::string shippedConfig() {
+  std::string path = __FILE__;
+  path = path.substr(0, path.rfind("test/test_config/")) + "data/config.json";
+  std::string text;
+  if (FILE *f = fopen(path.c_str(), "rb")) {
+    char buf[256];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) text.append(buf, n);
+    fclose(f);
+  }
+  return text;
+}
+
+void test_normalize_timezone_aliases() {
+  for (auto &alias : timezoneAliases) {
+    TEST_ASSERT_EQUAL_STRING(alias[1], normalizeTimezone(alias[0]));
+    TEST_ASSERT_EQUAL_STRING(alias[1], normalizeTimezone(alias[1]));
+  }
+  const char *tz = "JST-9";
+  TEST_ASSERT_TRUE(normalizeTimezone(tz) == tz);
+  TEST_ASSERT_EQUAL_STRING("", normalizeTimezone(""));
+}
+
+void test_migrate_schema_0() {
+  JsonDocument doc;
+  deserializeJson(doc, "{\"timezone\":\"CET-1CEST,M3.5.0/2,M10.5.0/3\",\"brightness\":50,\"use24h\":false}");
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_INT(CONFIG_SCHEMA, doc["schema"].as<int>());
+  TEST_ASSERT_EQUAL_STRING("CET-1CEST,M3.5.0,M10.5.0/3", doc["timezone"].as<const char *>());
+  TEST_ASSERT_EQUAL_INT(50, doc["brightness"].as<int>());
+  TEST_ASSERT_FALSE(doc["use24h"].as<bool>());
+  TEST_ASSERT_EQUAL_INT(4, (int)doc.size());
+  // migrating again is a no-op
+  std::string once = serialized(doc);
+  TEST_ASSERT_FALSE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING(once.c_str(), serialized(doc).c_str());
+}
+
+void test_migrate_keeps_unaliased_timezone() {
+  JsonDocument doc;
+  deserializeJson(doc, "{\"schema\":0,\"timezone\":\"EST5EDT,M3.2.0/2,M11.1.0\"}");
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING("EST5EDT,M3.2.0/2,M11.1.0", doc["timezone"].as<const char *>());
+}
+
+// Missing keys are left missing; configFromJson() fills in the defaults
+void test_migrate_missing_fields() {
+  JsonDocument doc;
+  deserializeJson(doc, "{}");
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING("{\"schema\":1}", serialized(doc).c_str());
+
+  deserializeJson(doc, "{\"timezone\":null,\"color\":\"#00FF00\"}");
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_TRUE(doc["timezone"].isNull());
+  TEST_ASSERT_EQUAL_STRING("#00FF00", doc["color"].as<const char *>());
+
+  deserializeJson(doc, "{\"timezone\":3600}");   // wrong type is left for configFromJson() to reject
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_INT(3600, doc["timezone"].as<int>());
+}
+
+void test_newer_schema_is_untouched() {
+  JsonDocument doc;
+  deserializeJson(doc, "{\"schema\":99,\"timezone\":\"CET-1CEST,M3.5.0/2,M10.5.0/3\"}");
+  std::string before = serialized(doc);
+  TEST_ASSERT_FALSE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING(before.c_str(), serialized(doc).c_str());
+}
+
+// The file shipped in the filesystem image is current and survives a
+// load/migrate/save cycle unchanged
+void test_shipped_config_round_trip() {
+  std::string text = shippedConfig();
+  TEST_ASSERT_TRUE(text.size() > 0);
+  JsonDocument doc;
+  TEST_ASSERT_FALSE(deserializeJson(doc, text));
+  TEST_ASSERT_EQUAL_INT(CONFIG_SCHEMA, doc["schema"].as<int>());
+  std::string before = serialized(doc);
+  TEST_ASSERT_FALSE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING(before.c_str(), serialized(doc).c_str());
+
+  JsonDocument reloaded;
+  TEST_ASSERT_FALSE(deserializeJson(reloaded, before));
+  TEST_ASSERT_EQUAL_STRING(before.c_str(), serialized(reloaded).c_str());
+
+  // the same file as a schema 0 install with an old timezone spelling
+  doc.remove("schema");
+  doc["timezone"] = timezoneAliases[0][0];
+  TEST_ASSERT_TRUE(migrateConfig(doc));
+  TEST_ASSERT_EQUAL_STRING(timezoneAliases[0][1], doc["timezone"].as<const char *>());
+  TEST_ASSERT_EQUAL_INT((int)reloaded.size(), (int)doc.size());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_normalize_timezone_aliases);
+  RUN_TEST(test_migrate_schema_0);
+  RUN_TEST(test_migrate_keeps_unaliased_timezone);
+  RUN_TEST(test_migrate_missing_fields);
+  RUN_TEST(test_newer_schema_is_untouched);
+  RUN_TEST(test_shipped_config_round_trip);
+  return UNITY_END();
+}
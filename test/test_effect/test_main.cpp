@@ -0,0 +1,186 @@
+// Host tests and benchmark for src/effectvm.h: pio test -e native
+#include <chrono>
+#include <initializer_list>
+#include <stdio.h>
+#include <unity.h>
+#include "effectvm.h"
+
+Effect effect;
+EffectFrame face;
+int32_t inputs[IN_COUNT] = {12, 34, 56, 789, 0, 0xFF0000, 1, 190};
+
+void setUp() {
+  effect = Effect();
+  for (auto &strip : face) {
+    for (auto &px : strip) px = 0xFF0000;
+  }
+}
+void tearDown() {}
+
+// Wraps raw code in the upload header and loads it like the clock does
+bool load(std::initializer_list<uint8_t> code) {
+  uint8_t buf[EFFECT_HEADER_SIZE + EFFECT_CODE_MAX];
+  memcpy(buf, EFFECT_MAGIC, 4);
+  buf[4] = EFFECT_VERSION;
+  buf[5] = 5;
+  buf[6] = code.size();
+  buf[7] = code.size() >> 8;
+  if (code.size()) memcpy(buf + EFFECT_HEADER_SIZE, code.begin(), code.size());
+  return effectParse(effect, buf, EFFECT_HEADER_SIZE + code.size());
+}
+
+EffectResult run(uint16_t &steps) {
+  return effectRun(effect, face, inputs, steps);
+}
+
+// Runs `a OP b` and returns what the program stored in r0
+int32_t arith(int32_t a, int32_t b, uint8_t op) {
+  uint8_t a0 = a, a1 = a >> 8, a2 = a >> 16, a3 = a >> 24;
+  uint8_t b0 = b, b1 = b >> 8, b2 = b >> 16, b3 = b >> 24;
+  if (!load({OP_PUSH32, a0, a1, a2, a3, OP_PUSH32, b0, b1, b2, b3, op, OP_STORE, 0})) return 0x7EADBEEF;
+  uint16_t steps;
+  if (run(steps) != EFFECT_OK) return 0x7EADBEEF;
+  return effect.regs[0];
+}
+
+void test_arithmetic_wraps_at_32_bits() {
+  TEST_ASSERT_EQUAL_INT32(INT32_MIN, arith(INT32_MAX, 1, OP_ADD));
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, arith(INT32_MIN, 1, OP_SUB));
+  TEST_ASSERT_EQUAL_INT32(0, arith(0x10000, 0x10000, OP_MUL));
+  TEST_ASSERT_EQUAL_INT32(-2, arith(INT32_MAX, 2, OP_MUL));
+}
+
+void test_division_truncates_and_never_traps() {
+  TEST_ASSERT_EQUAL_INT32(-3, arith(-7, 2, OP_DIV));
+  TEST_ASSERT_EQUAL_INT32(-1, arith(-7, 2, OP_MOD));
+  TEST_ASSERT_EQUAL_INT32(0, arith(5, 0, OP_DIV));
+  TEST_ASSERT_EQUAL_INT32(0, arith(5, 0, OP_MOD));
+  TEST_ASSERT_EQUAL_INT32(INT32_MIN, arith(INT32_MIN, -1, OP_DIV));
+  TEST_ASSERT_EQUAL_INT32(0, arith(INT32_MIN, -1, OP_MOD));
+  TEST_ASSERT_EQUAL_INT32(-5, arith(5, -1, OP_DIV));
+}
+
+void test_shifts_compare_and_logic() {
+  TEST_ASSERT_EQUAL_INT32(INT32_MIN, arith(1, 31, OP_SHL));
+  TEST_ASSERT_EQUAL_INT32(2, arith(1, 33, OP_SHL));   // shift count is taken mod 32
+  TEST_ASSERT_EQUAL_INT32(0x7FFFFFFF, arith(-1, 1, OP_SHR));
+  TEST_ASSERT_EQUAL_INT32(1, arith(-1, 0, OP_LT));
+  TEST_ASSERT_EQUAL_INT32(0, arith(3, 3, OP_LT));
+  TEST_ASSERT_EQUAL_INT32(1, arith(3, 3, OP_EQ));
+  TEST_ASSERT_EQUAL_INT32(0x0F, arith(0x3C, 0x33, OP_XOR));
+}
+
+void test_pixel_digit_and_dots() {
+  face[HOUR_STRIP][8 + 3] = 0;   // an unlit segment of h1
+  TEST_ASSERT_TRUE(load({
+    OP_PUSH8, 16, OP_PUSH32, 0x56, 0x34, 0x12, 0xFF, OP_PIXEL,   // color is masked to 24 bits
+    OP_PUSH8, 0, OP_PUSH32, 0xFF, 0x00, 0x00, 0x00, OP_DIGIT,
+    OP_PUSH16, 0x80, 0x00, OP_DOTS,
+    OP_PUSH8, 16, OP_GETPX, OP_STORE, 0,
+  }));
+  uint16_t steps;
+  TEST_ASSERT_EQUAL(EFFECT_OK, run(steps));
+  TEST_ASSERT_EQUAL(11, steps);
+  TEST_ASSERT_EQUAL_HEX32(0x123456, face[MINUTE_STRIP][1]);
+  TEST_ASSERT_EQUAL_HEX32(0x123456, (uint32_t)effect.regs[0]);
+  TEST_ASSERT_EQUAL_HEX32(0x0000FF, face[HOUR_STRIP][8]);
+  TEST_ASSERT_EQUAL_HEX32(0, face[HOUR_STRIP][8 + 3]);   // unlit segments stay dark
+  TEST_ASSERT_EQUAL_HEX32(0xFF0000, face[HOUR_STRIP][1]);
+  TEST_ASSERT_EQUAL_HEX32(0x80, face[HOUR_STRIP][0]);
+  TEST_ASSERT_EQUAL_HEX32(0x80, face[MINUTE_STRIP][0]);
+}
+
+void test_faults() {
+  uint16_t steps;
+  TEST_ASSERT_TRUE(load({OP_ADD}));
+  TEST_ASSERT_EQUAL(EFFECT_FAULT, run(steps));
+  TEST_ASSERT_TRUE(load({OP_PUSH8, 30, OP_GETPX}));
+  TEST_ASSERT_EQUAL(EFFECT_FAULT, run(steps));
+  TEST_ASSERT_TRUE(load({OP_PUSH8, 0xFF, OP_PUSH8, 0, OP_PIXEL}));
+  TEST_ASSERT_EQUAL(EFFECT_FAULT, run(steps));
+  TEST_ASSERT_TRUE(load({OP_PUSH8, 4, OP_PUSH8, 0, OP_DIGIT}));
+  TEST_ASSERT_EQUAL(EFFECT_FAULT, run(steps));
+  TEST_ASSERT_TRUE(load({OP_PUSH8, 1, OP_DUP, OP_JMP, 2, 0}));   // stack overflow
+  TEST_ASSERT_EQUAL(EFFECT_FAULT, run(steps));
+  TEST_ASSERT_EQUAL(1 + (EFFECT_STACK - 1) * 2, steps);
+}
+
+// A loop that never ends stops at the budget, and the next frame starts
+// over with the registers it left behind
+void test_budget_overrun_keeps_registers() {
+  TEST_ASSERT_TRUE(load({OP_LOAD, 0, OP_PUSH8, 1, OP_ADD, OP_STORE, 0, OP_JMP, 0, 0}));
+  uint16_t steps;
+  TEST_ASSERT_EQUAL(EFFECT_OVERRUN, run(steps));
+  TEST_ASSERT_EQUAL(EFFECT_BUDGET, steps);
+  TEST_ASSERT_EQUAL_INT32(EFFECT_BUDGET / 5, effect.regs[0]);
+  TEST_ASSERT_EQUAL(EFFECT_OVERRUN, run(steps));
+  TEST_ASSERT_EQUAL_INT32(2 * (EFFECT_BUDGET / 5), effect.regs[0]);
+}
+
+void test_validator_rejects_unsafe_code() {
+  TEST_ASSERT_FALSE(load({OP_COUNT}));                          // unknown opcode
+  TEST_ASSERT_FALSE(load({OP_PUSH16, 1}));                      // operand past the end
+  TEST_ASSERT_FALSE(load({OP_LOAD, EFFECT_REGS}));
+  TEST_ASSERT_FALSE(load({OP_IN, IN_COUNT}));
+  TEST_ASSERT_FALSE(load({OP_PUSH8, 0, OP_JMP, 1, 0}));         // into an operand
+  TEST_ASSERT_FALSE(load({OP_JMP, 3, 0}));                      // past the end
+  TEST_ASSERT_FALSE(effect.loaded);
+  TEST_ASSERT_FALSE(load({}));
+  uint8_t wrongVersion[] = {'7', 'S', 'F', 'X', EFFECT_VERSION + 1, 5, 1, 0, OP_END};
+  TEST_ASSERT_FALSE(effectParse(effect, wrongVersion, sizeof(wrongVersion)));
+  TEST_ASSERT_TRUE(load({OP_PUSH8, 0, OP_JZ, 0, 0}));
+  TEST_ASSERT_EQUAL(50, effect.frameMs);
+}
+
+// tools/effects/rainbow.fx as assembled by tools/effectc.py
+const uint8_t rainbow[] = {
+  0x37, 0x53, 0x46, 0x58, 0x01, 0x05, 0x2c, 0x00, 0x01, 0x00, 0x05, 0x00, 0x04, 0x00, 0x06, 0x04,
+  0x01, 0x20, 0x09, 0x01, 0x19, 0x0a, 0x04, 0x00, 0x01, 0x40, 0x09, 0x07, 0x02, 0xff, 0x00, 0x0c,
+  0x1d, 0x1b, 0x04, 0x00, 0x01, 0x01, 0x07, 0x14, 0x05, 0x00, 0x01, 0x04, 0x11, 0x18, 0x2b, 0x00,
+  0x17, 0x04, 0x00, 0x00,
+};
+
+void test_rainbow_colors_each_digit() {
+  TEST_ASSERT_TRUE(effectParse(effect, rainbow, sizeof(rainbow)));
+  uint16_t steps;
+  inputs[IN_FRAME] = 0;
+  TEST_ASSERT_EQUAL(EFFECT_OK, run(steps));
+  TEST_ASSERT_EQUAL(93, steps);
+  for (int d = 0; d < 4; d++) {
+    TEST_ASSERT_EQUAL_HEX32(colorWheel(d * 64), face[digitStripIndex[d]][digitStartIndex[d]]);
+  }
+}
+
+// Interpreter speed on the host. The clock reports its own numbers under
+// `effect` in /api/bench; this only catches large regressions between builds.
+void test_benchmark_rainbow() {
+  TEST_ASSERT_TRUE(effectParse(effect, rainbow, sizeof(rainbow)));
+  const int frames = 200000;
+  uint32_t instructions = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int n = 0; n < frames; n++) {
+    inputs[IN_FRAME] = n;
+    uint16_t steps;
+    if (run(steps) != EFFECT_OK) TEST_FAIL_MESSAGE("rainbow faulted or overran");
+    instructions += steps;
+  }
+  double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  char msg[128];
+  snprintf(msg, sizeof(msg), "rainbow: %.0f ns/frame, %.2f ns/instruction on the host", ns / frames, ns / instructions);
+  TEST_MESSAGE(msg);
+  TEST_ASSERT_EQUAL_UINT32(93u * frames, instructions);
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_arithmetic_wraps_at_32_bits);
+  RUN_TEST(test_division_truncates_and_never_traps);
+  RUN_TEST(test_shifts_compare_and_logic);
+  RUN_TEST(test_pixel_digit_and_dots);
+  RUN_TEST(test_faults);
+  RUN_TEST(test_budget_overrun_keeps_registers);
+  RUN_TEST(test_validator_rejects_unsafe_code);
+  RUN_TEST(test_rainbow_colors_each_digit);
+  RUN_TEST(test_benchmark_rainbow);
+  return UNITY_END();
+}
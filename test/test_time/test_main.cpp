@@ -0,0 +1,113 @@
+// Host tests for src/timeutil.h: pio test -e native
+#include <unity.h>
+#include "timeutil.h"
+
+void setUp() {}
+void tearDown() {}
+
+void test_days_from_civil() {
+  TEST_ASSERT_EQUAL_INT64(0, daysFromCivil(1970, 1, 1));
+  TEST_ASSERT_EQUAL_INT64(-1, daysFromCivil(1969, 12, 31));
+  TEST_ASSERT_EQUAL_INT64(11016, daysFromCivil(2000, 2, 29));
+  TEST_ASSERT_EQUAL_INT64(17167, daysFromCivil(2017, 1, 1));
+}
+
+void test_http_date_rfc_example() {
+  time_t t = 0;
+  TEST_ASSERT_TRUE(parseHttpDate("Sun, 06 Nov 1994 08:49:37 GMT", t));
+  TEST_ASSERT_EQUAL_INT64(784111777, (int64_t)t);
+}
+
+void test_http_date_month_and_year_edges() {
+  time_t t = 0;
+  TEST_ASSERT_TRUE(parseHttpDate("Sat, 31 Dec 2016 23:59:59 GMT", t));
+  TEST_ASSERT_EQUAL_INT64(1483228799, (int64_t)t);
+  TEST_ASSERT_TRUE(parseHttpDate("Thu, 29 Feb 2024 12:00:00 GMT", t));
+  TEST_ASSERT_EQUAL_INT64(1709208000, (int64_t)t);
+  TEST_ASSERT_TRUE(parseHttpDate("Wed, 01 Jan 2070 00:00:00 GMT", t));
+  TEST_ASSERT_EQUAL_INT64(3155760000LL, (int64_t)t);
+}
+
+void test_http_date_rejects_malformed() {
+  time_t t = 42;
+  TEST_ASSERT_FALSE(parseHttpDate("", t));
+  TEST_ASSERT_FALSE(parseHttpDate("Sun, 06 Nov 1994", t));
+  TEST_ASSERT_FALSE(parseHttpDate("Sun, 06 nov 1994 08:49:37 GMT", t));
+  TEST_ASSERT_FALSE(parseHttpDate("Sun, 06 Foo 1994 08:49:37 GMT", t));
+  TEST_ASSERT_FALSE(parseHttpDate("Sunday, 06-Nov-94 08:49:37 GMT", t));   // RFC 850 form is not accepted
+  TEST_ASSERT_EQUAL_INT64(42, (int64_t)t);
+}
+
+// 2016-12-31 ended with an inserted leap second; a 24 h window smears it
+// from 12:00 UTC on the 31st to 12:00 UTC on 1 January
+const time_t LEAP_AT = 1483228800;
+const uint32_t WINDOW_S = 24 * 3600;
+const int64_t S = 1000000;
+
+void test_leap_smear_window_edges() {
+  int64_t at = (int64_t)LEAP_AT * S;
+  TEST_ASSERT_EQUAL_INT64(0, leapSmearUs(at - 12 * 3600 * S - 1, LEAP_AT, 1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(0, leapSmearUs(at - 12 * 3600 * S, LEAP_AT, 1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(-S / 2, leapSmearUs(at, LEAP_AT, 1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(-S, leapSmearUs(at + 12 * 3600 * S, LEAP_AT, 1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(-S, leapSmearUs(at + 48 * 3600 * S, LEAP_AT, 1, WINDOW_S));
+  // one hour into the window is 1/24 of the second
+  TEST_ASSERT_EQUAL_INT64(-S / 24, leapSmearUs(at - 11 * 3600 * S, LEAP_AT, 1, WINDOW_S));
+}
+
+void test_leap_smear_negative_second() {
+  int64_t at = (int64_t)LEAP_AT * S;
+  TEST_ASSERT_EQUAL_INT64(0, leapSmearUs(at - 12 * 3600 * S, LEAP_AT, -1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(S / 2, leapSmearUs(at, LEAP_AT, -1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(S, leapSmearUs(at + 12 * 3600 * S, LEAP_AT, -1, WINDOW_S));
+}
+
+void test_leap_step_without_window() {
+  int64_t at = (int64_t)LEAP_AT * S;
+  TEST_ASSERT_EQUAL_INT64(0, leapSmearUs(at - 1, LEAP_AT, 1, 0));
+  TEST_ASSERT_EQUAL_INT64(-S, leapSmearUs(at, LEAP_AT, 1, 0));
+  TEST_ASSERT_EQUAL_INT64(S, leapSmearUs(at, LEAP_AT, -1, 0));
+}
+
+// Upstream POSIX time repeats a second for an inserted leap (and skips one
+// for a deleted leap); the smeared target must still advance with real time
+void test_leap_target_is_continuous_across_the_step() {
+  int64_t at = (int64_t)LEAP_AT * S;
+  TEST_ASSERT_EQUAL_INT64(at + 5 * S, leapTargetUs(at + 5 * S, LEAP_AT, 0, WINDOW_S));
+  // +1: two real seconds pass between POSIX at - 1 s and at
+  int64_t before = leapTargetUs(at - S, LEAP_AT, 1, WINDOW_S);
+  int64_t after = leapTargetUs(at, LEAP_AT, 1, WINDOW_S);
+  TEST_ASSERT_INT64_WITHIN(1, 2 * S - 2 * S / (int64_t)WINDOW_S, after - before);
+  TEST_ASSERT_EQUAL_INT64(at + 13 * 3600 * S - S, leapTargetUs(at + 13 * 3600 * S - S, LEAP_AT, 1, WINDOW_S));
+  // -1: POSIX at - 1 s is skipped, at - 2 s and at are one real second apart
+  before = leapTargetUs(at - 2 * S, LEAP_AT, -1, WINDOW_S);
+  after = leapTargetUs(at, LEAP_AT, -1, WINDOW_S);
+  TEST_ASSERT_INT64_WITHIN(1, S + S / (int64_t)WINDOW_S, after - before);
+  TEST_ASSERT_EQUAL_INT64(at + 13 * 3600 * S, leapTargetUs(at + 13 * 3600 * S, LEAP_AT, -1, WINDOW_S));
+}
+
+// An announcement that first arrives inside the window (late sync, reboot
+// during the smear) lands on the smear's current value instead of starting
+// it from zero, and follows the same slope from there
+void test_leap_announced_mid_smear() {
+  int64_t at = (int64_t)LEAP_AT * S;
+  int64_t posix = at - 6 * 3600 * S;   // 18:00 UTC, a quarter into the window
+  TEST_ASSERT_EQUAL_INT64(posix - S / 4, leapTargetUs(posix, LEAP_AT, 1, WINDOW_S));
+  TEST_ASSERT_EQUAL_INT64(posix + 3600 * S - S / 4 - S / 24, leapTargetUs(posix + 3600 * S, LEAP_AT, 1, WINDOW_S));
+  posix = at + 6 * 3600 * S;           // after the upstream step, three quarters in
+  TEST_ASSERT_INT64_WITHIN(1, posix + S - 3 * S / 4 - S / (int64_t)WINDOW_S, leapTargetUs(posix, LEAP_AT, 1, WINDOW_S));
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_days_from_civil);
+  RUN_TEST(test_http_date_rfc_example);
+  RUN_TEST(test_http_date_month_and_year_edges);
+  RUN_TEST(test_http_date_rejects_malformed);
+  RUN_TEST(test_leap_smear_window_edges);
+  RUN_TEST(test_leap_smear_negative_second);
+  RUN_TEST(test_leap_step_without_window);
+  RUN_TEST(test_leap_target_is_continuous_across_the_step);
+  RUN_TEST(test_leap_announced_mid_smear);
+  return UNITY_END();
+}
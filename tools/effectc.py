@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+"""Assembler for 7sClock display effects.
+
+Turns a small assembly listing into the bytecode the clock runs from
+/effect.bin, optionally checks it against the per-frame instruction budget,
+and uploads it. --check builds tools/effectcheck.cpp with the host C++
+compiler ($CXX, else c++), so the program runs through src/effectvm.h, the
+same interpreter the clock uses.
+
+    python3 tools/effectc.py tools/effects/rainbow.fx -o rainbow.bin
+    python3 tools/effectc.py tools/effects/rainbow.fx --check
+    python3 tools/effectc.py tools/effects/rainbow.fx --upload 7sclock.local
+
+Source format, one instruction per line, ';' starts a comment:
+
+    .frame 50        frame period in ms (20..1000, 10 ms steps)
+    name:            label, target of jmp / jz
+    push N           push a constant (encoded as 8, 16 or 32 bit)
+    load rN          push register N (0..15), registers persist across frames
+    store rN         pop into register N
+    in NAME          push an input: hour minute second millis frame color dots brightness
+    add sub mul div mod and or xor shl shr lt eq
+                     pop b, pop a, push a OP b (32-bit wrapping arithmetic,
+                     div/mod by zero give 0, div truncates toward zero)
+    not dup drop swap
+    jmp LABEL        jump
+    jz LABEL         pop, jump if zero
+    pixel            pop color, pop index (0..14 hour strip, 15..29 minute strip), set it
+    getpx            pop index, push its color
+    digit            pop color, pop digit (0..3), recolor the lit segments of that digit
+    dots             pop color, set both dots
+    wheel            pop 0..255, push a rainbow color
+    scale            pop factor (0..256), pop color, push the dimmed color
+    end              finish the frame
+
+Colors are 0xRRGGBB. Every frame starts with an empty stack at the first
+instruction with the clock face already drawn in the configured color.
+Programs work in plain colors: getpx returns what the theme or an earlier
+pixel, digit or dots wrote, and the strip calibration (white point and
+gamma) is applied once when the frame is sent to the LEDs.
+"""
+
+import argparse
+import os
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import urllib.request
+
+MAGIC = b"7SFX"
+VERSION = 1
+CODE_MAX = 512
+REGS = 16
+
+OPS = ["end", "push8", "push16", "push32", "load", "store", "in",
+       "add", "sub", "mul", "div", "mod", "and", "or", "xor", "shl", "shr",
+       "lt", "eq", "not", "dup", "drop", "swap", "jmp", "jz",
+       "pixel", "getpx", "digit", "dots", "wheel", "scale"]
+OPERAND = {"push8": 1, "push16": 2, "push32": 4, "load": 1, "store": 1, "in": 1, "jmp": 2, "jz": 2}
+INPUTS = ["hour", "minute", "second", "millis", "frame", "color", "dots", "brightness"]
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+
+class AsmError(Exception):
+    pass
+
+
+def parse_int(text, line_no):
+    try:
+        return int(text, 0)
+    except ValueError:
+        raise AsmError(f"line {line_no}: bad number '{text}'")
+
+
+def parse_reg(text, line_no):
+    if not text.startswith("r") or not text[1:].isdigit() or int(text[1:]) >= REGS:
+        raise AsmError(f"line {line_no}: bad register '{text}'")
+    return int(text[1:])
+
+
+def assemble(source):
+    frame_ms = 50
+    items = []   # (line, op, argument)
+    for line_no, raw in enumerate(source.splitlines(), 1):
+        line = raw.split(";", 1)[0].strip()
+        if not line:
+            continue
+        if line.endswith(":"):
+            items.append((line_no, "label", line[:-1]))
+            continue
+        parts = line.split()
+        name, args = parts[0].lower(), parts[1:]
+        if name == ".frame":
+            frame_ms = parse_int(args[0], line_no)
+            if not 20 <= frame_ms <= 1000:
+                raise AsmError(f"line {line_no}: frame period must be 20..1000 ms")
+            continue
+        if name == "push":
+            value = parse_int(args[0], line_no)
+            if not -2**31 <= value < 2**32:
+                raise AsmError(f"line {line_no}: constant out of range")
+            if value >= 2**31:
+                value -= 2**32
+            name = "push8" if -128 <= value < 128 else "push16" if -32768 <= value < 32768 else "push32"
+            items.append((line_no, name, value))
+        elif name in ("load", "store"):
+            items.append((line_no, name, parse_reg(args[0], line_no)))
+        elif name == "in":
+            if args[0] not in INPUTS:
+                raise AsmError(f"line {line_no}: unknown input '{args[0]}'")
+            items.append((line_no, name, INPUTS.index(args[0])))
+        elif name in ("jmp", "jz"):
+            items.append((line_no, name, args[0]))
+        elif name in OPS and name not in OPERAND:
+            if args:
+                raise AsmError(f"line {line_no}: '{name}' takes no operand")
+            items.append((line_no, name, None))
+        else:
+            raise AsmError(f"line {line_no}: unknown instruction '{name}'")
+
+    labels = {}
+    pc = 0
+    for line_no, name, arg in items:
+        if name == "label":
+            if arg in labels:
+                raise AsmError(f"line {line_no}: duplicate label '{arg}'")
+            labels[arg] = pc
+        else:
+            pc += 1 + OPERAND.get(name, 0)
+
+    code = bytearray()
+    for line_no, name, arg in items:
+        if name == "label":
+            continue
+        code.append(OPS.index(name))
+        if name in ("jmp", "jz"):
+            if arg not in labels or labels[arg] >= pc:
+                raise AsmError(f"line {line_no}: jump to unknown or trailing label '{arg}'")
+            code += struct.pack("<H", labels[arg])
+        elif name == "push8":
+            code += struct.pack("<b", arg)
+        elif name == "push16":
+            code += struct.pack("<h", arg)
+        elif name == "push32":
+            code += struct.pack("<i", arg)
+        elif name in OPERAND:
+            code.append(arg)
+    if not code:
+        raise AsmError("empty program")
+    if len(code) > CODE_MAX:
+        raise AsmError(f"program is {len(code)} bytes, the clock accepts {CODE_MAX}")
+    return MAGIC + bytes([VERSION, frame_ms // 10]) + struct.pack("<H", len(code)) + code
+
+
+def check(binary, frames):
+    """Runs the program through src/effectvm.h, the interpreter the clock runs."""
+    cxx = os.environ.get("CXX") or shutil.which("c++") or shutil.which("g++") or shutil.which("clang++")
+    if not cxx:
+        print("--check needs a host C++ compiler (set CXX)", file=sys.stderr)
+        return False
+    with tempfile.TemporaryDirectory() as tmp:
+        runner = os.path.join(tmp, "effectcheck")
+        build = subprocess.run([cxx, "-std=gnu++17", "-O2", "-I", os.path.join(ROOT, "src"),
+                                os.path.join(ROOT, "tools", "effectcheck.cpp"), "-o", runner])
+        if build.returncode:
+            return False
+        program = os.path.join(tmp, "effect.bin")
+        with open(program, "wb") as f:
+            f.write(binary)
+        return subprocess.run([runner, program, str(frames)]).returncode == 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Assemble a 7sClock display effect")
+    parser.add_argument("source")
+    parser.add_argument("-o", "--output", help="write the bytecode to this file")
+    parser.add_argument("--check", action="store_true", help="run the program through the clock's interpreter on the host and report its instruction count")
+    parser.add_argument("--frames", type=int, default=600, help="frames to simulate with --check (default 600)")
+    parser.add_argument("--upload", metavar="HOST", help="POST the bytecode to http://HOST/api/effect")
+    args = parser.parse_args()
+
+    with open(args.source) as f:
+        try:
+            binary = assemble(f.read())
+        except AsmError as e:
+            sys.exit(f"{args.source}: {e}")
+    print(f"{args.source}: {len(binary) - 8} bytes of code, {binary[5] * 10} ms frames")
+
+    if args.check and not check(binary, args.frames):
+        sys.exit(1)
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(binary)
+    if args.upload:
+        req = urllib.request.Request(f"http://{args.upload}/api/effect", data=binary, method="POST",
+                                     headers={"Content-Type": "application/octet-stream"})
+        with urllib.request.urlopen(req, timeout=10) as resp:
+            print(resp.read().decode().strip())
+
+
+if __name__ == "__main__":
+    main()
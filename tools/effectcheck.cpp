@@ -0,0 +1,52 @@
+// Host runner for `tools/effectc.py --check`: runs an assembled effect
+// through src/effectvm.h, the interpreter the clock runs, and reports its
+// worst-case instruction count. effectc.py builds it with the host C++
+// compiler; by hand:
+//
+//   c++ -std=gnu++17 -O2 -I src tools/effectcheck.cpp -o effectcheck
+//   ./effectcheck rainbow.bin 600
+#include <stdio.h>
+#include <stdlib.h>
+#include "effectvm.h"
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "usage: %s EFFECT.bin FRAMES\n", argv[0]);
+    return 2;
+  }
+  uint8_t buf[EFFECT_HEADER_SIZE + EFFECT_CODE_MAX + 1];
+  FILE *f = fopen(argv[1], "rb");
+  if (!f) {
+    perror(argv[1]);
+    return 2;
+  }
+  size_t len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  static Effect effect;
+  if (!effectParse(effect, buf, len)) {
+    fprintf(stderr, "%s: rejected by the clock's validator\n", argv[1]);
+    return 1;
+  }
+  int frames = atoi(argv[2]);
+  uint16_t worst = 0;
+  int overruns = 0;
+  for (int n = 0; n < frames; n++) {
+    // Noon-ish clock face with every pixel lit in the default red
+    uint32_t ms = n * effect.frameMs;
+    int32_t inputs[IN_COUNT] = {12, 34, (int32_t)(ms / 1000 % 60), (int32_t)(ms % 1000), n, 0xFF0000, 1, 190};
+    EffectFrame face;
+    for (auto &strip : face) {
+      for (auto &px : strip) px = 0xFF0000;
+    }
+    uint16_t steps;
+    EffectResult r = effectRun(effect, face, inputs, steps);
+    if (r == EFFECT_FAULT) {
+      fprintf(stderr, "frame %d: fault after %u instructions\n", n, steps);
+      return 1;
+    }
+    if (r == EFFECT_OVERRUN) overruns++;
+    if (steps > worst) worst = steps;
+  }
+  printf("%d frames: at most %u of %u instructions per frame, %d overruns\n", frames, worst, EFFECT_BUDGET, overruns);
+  return overruns ? 1 : 0;
+}
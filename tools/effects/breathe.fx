@@ -0,0 +1,19 @@
+; The dots fade in and out in the configured color instead of blinking
+.frame 40
+        in color
+        in millis
+        in second
+        push 1
+        and
+        jz rising           ; even seconds fade in, odd seconds fade out
+        push 999
+        swap
+        sub
+rising:
+        push 256
+        mul
+        push 1000
+        div
+        scale
+        dots
+        end
@@ -0,0 +1,30 @@
+; Each digit in its own hue, the rainbow turns once every 10 seconds
+.frame 50
+        push 0
+        store r0            ; digit index
+next:
+        load r0             ; digit for `digit`
+        in frame
+        push 32
+        mul
+        push 25
+        div                 ; 256 hue steps per 200 frames
+        load r0
+        push 64
+        mul
+        add
+        push 255
+        and
+        wheel
+        digit
+        load r0
+        push 1
+        add
+        dup
+        store r0
+        push 4
+        lt
+        jz done
+        jmp next
+done:
+        end
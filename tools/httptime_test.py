@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""End-to-end test of the HTTP Date fallback against a local stand-in.
+
+Serves HEAD requests from this machine with a Date header a few seconds
+ahead, points the clock's fallback URL at it and its NTP server at an
+unreachable address, and waits until the clock has taken its time from the
+stand-in. It then asks the clock's NTP server mode for the time and checks
+that it advertises stratum 15, the lowest valid stratum, whatever NTP
+stratum the clock had before:
+
+    python3 tools/httptime_test.py 7sclock.local
+
+The clock's config is read first and restored at the end, which also sends
+it back to its NTP server. The skew makes sure the coarse HTTP sample
+replaces an existing NTP fix instead of being ignored as within its error.
+"""
+
+import argparse
+import email.utils
+import http.server
+import json
+import socket
+import struct
+import sys
+import threading
+import time
+import urllib.request
+
+UNREACHABLE_NTP = "192.0.2.1"   # TEST-NET-1, never answers
+
+
+class StandIn(http.server.BaseHTTPRequestHandler):
+    skew = 0
+    heads = 0
+
+    def do_HEAD(self):
+        StandIn.heads += 1
+        self.send_response_only(200)
+        self.send_header("Date", email.utils.formatdate(time.time() + StandIn.skew, usegmt=True))
+        self.send_header("Content-Length", "0")
+        self.end_headers()
+
+    def log_message(self, *args):
+        pass
+
+
+def api(host, path, body=None):
+    req = urllib.request.Request(f"http://{host}{path}", data=body, method="POST" if body is not None else "GET")
+    with urllib.request.urlopen(req, timeout=10) as resp:
+        return resp.read()
+
+
+def time_status(host):
+    return json.loads(api(host, "/api/metrics"))["time"]
+
+
+def ntp_stratum(host):
+    """Sends one SNTP client request and returns the stratum of the reply."""
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.settimeout(3)
+        s.sendto(b"\x23" + b"\0" * 47, (host, 123))   # LI 0, version 4, mode 3
+        reply, _ = s.recvfrom(48)
+    if len(reply) < 48 or reply[0] & 7 != 4:
+        raise ValueError("not an NTP server reply")
+    return reply[1]
+
+
+def local_ip_towards(host):
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as s:
+        s.connect((host, 80))
+        return s.getsockname()[0]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Test the 7sClock HTTP time fallback against a local stand-in")
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=8000, help="port of the stand-in (default 8000)")
+    parser.add_argument("--skew", type=float, default=3, help="seconds the stand-in's Date is ahead (default 3)")
+    parser.add_argument("--timeout", type=float, default=60, help="seconds to wait for the fallback (default 60)")
+    args = parser.parse_args()
+
+    host = socket.gethostbyname(args.host)
+    saved = api(host, "/api/config")
+    before = time_status(host)
+    print(f"before: source {before['source']}, stratum {before['stratum']}")
+
+    StandIn.skew = args.skew
+    server = http.server.ThreadingHTTPServer(("", args.port), StandIn)
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    url = f"http://{local_ip_towards(host)}:{args.port}/"
+    ok = False
+    try:
+        batch = [
+            {"op": "set", "key": "timeFallbackUrl", "value": url},
+            {"op": "set", "key": "ntpServerMode", "value": True},
+            {"op": "set", "key": "ntpServer", "value": UNREACHABLE_NTP},
+        ]
+        api(host, "/api/batch", json.dumps(batch).encode())
+        print(f"waiting for the clock to fetch {url}")
+        deadline = time.time() + args.timeout
+        status = time_status(host)
+        while status["source"] != "http" and time.time() < deadline:
+            time.sleep(2)
+            status = time_status(host)
+        if status["source"] != "http":
+            print(f"FAIL: source is still {status['source']} after {args.timeout:.0f} s ({StandIn.heads} HEAD requests)")
+            return 1
+        stratum = ntp_stratum(host)
+        print(f"after: source http, stratum {status['stratum']}, NTP server mode answers stratum {stratum}")
+        ok = status["stratum"] == 15 and stratum == 15
+        print("PASS" if ok else "FAIL: time from an HTTP Date must be served at stratum 15")
+    finally:
+        api(host, "/api/config", saved)
+        server.shutdown()
+        print("config restored")
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+"""Load test for the 7sClock JSON API.
+
+Fires GET requests at one endpoint from several concurrent workers and
+reports throughput and latency, so the keep-alive listener on port 8080 can
+be compared with the close-per-request server on port 80:
+
+    python3 tools/loadtest.py 7sclock.local --mode close
+    python3 tools/loadtest.py 7sclock.local --mode keepalive
+    python3 tools/loadtest.py 7sclock.local --mode pipeline --depth 4
+
+Modes:
+
+    close       a new TCP connection per request (port 80 by default)
+    keepalive   one persistent connection per worker, one request in flight
+    pipeline    one persistent connection per worker, --depth requests
+                written back to back before the responses are read
+
+A connection the clock closes (idle timeout, request limit, 503 when all
+keep-alive sessions are taken) is reopened and counted under "reconnects".
+Use --compare to run close and keepalive back to back.
+"""
+
+import argparse
+import socket
+import statistics
+import threading
+import time
+
+
+class Response:
+    def __init__(self, status, keep_alive, body):
+        self.status = status
+        self.keep_alive = keep_alive
+        self.body = body
+
+
+def read_response(f):
+    """Reads one HTTP/1.1 response with a Content-Length body."""
+    line = f.readline()
+    if not line:
+        raise ConnectionError("closed")
+    status = int(line.split()[1])
+    length = 0
+    keep_alive = True
+    while True:
+        line = f.readline()
+        if line in (b"\r\n", b""):
+            break
+        name, _, value = line.decode("latin-1").partition(":")
+        name = name.strip().lower()
+        if name == "content-length":
+            length = int(value)
+        elif name == "connection" and "close" in value.lower():
+            keep_alive = False
+    return Response(status, keep_alive, f.read(length))
+
+
+class Worker(threading.Thread):
+    def __init__(self, args, port, deadline):
+        super().__init__(daemon=True)
+        self.args = args
+        self.port = port
+        self.deadline = deadline
+        self.latencies = []
+        self.errors = 0
+        self.reconnects = 0
+        self.statuses = {}
+        self.request = ("GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n" % (
+            args.path, args.host, "Connection: close\r\n" if args.mode == "close" else "")).encode()
+
+    def connect(self):
+        s = socket.create_connection((self.args.host, self.port), timeout=self.args.timeout)
+        s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        return s, s.makefile("rb")
+
+    def record(self, response, started):
+        self.latencies.append(time.perf_counter() - started)
+        self.statuses[response.status] = self.statuses.get(response.status, 0) + 1
+
+    def run(self):
+        conn = None
+        while time.perf_counter() < self.deadline:
+            try:
+                if conn is None:
+                    conn = self.connect()
+                sock, f = conn
+                depth = self.args.depth if self.args.mode == "pipeline" else 1
+                started = time.perf_counter()
+                sock.sendall(self.request * depth)
+                open_after = True
+                for _ in range(depth):
+                    r = read_response(f)
+                    self.record(r, started)
+                    open_after = open_after and r.keep_alive
+                if self.args.mode == "close" or not open_after:
+                    sock.close()
+                    conn = None
+                    if self.args.mode != "close":
+                        self.reconnects += 1
+            except (OSError, ConnectionError, ValueError, IndexError):
+                self.errors += 1
+                if conn:
+                    conn[0].close()
+                conn = None
+                if self.args.mode != "close":
+                    self.reconnects += 1
+        if conn:
+            conn[0].close()
+
+
+def run(args, mode):
+    args.mode = mode
+    port = args.port or (80 if mode == "close" else 8080)
+    deadline = time.perf_counter() + args.duration
+    workers = [Worker(args, port, deadline) for _ in range(args.concurrency)]
+    started = time.perf_counter()
+    for w in workers:
+        w.start()
+    for w in workers:
+        w.join()
+    elapsed = time.perf_counter() - started
+    latencies = sorted(l for w in workers for l in w.latencies)
+    statuses = {}
+    for w in workers:
+        for k, v in w.statuses.items():
+            statuses[k] = statuses.get(k, 0) + v
+    print("%s on port %d: %d requests in %.1f s, %.1f req/s" % (mode, port, len(latencies), elapsed, len(latencies) / elapsed))
+    if latencies:
+        ms = [l * 1000 for l in latencies]
+        print("  latency ms: median %.1f  p90 %.1f  p99 %.1f  max %.1f" % (
+            statistics.median(ms), ms[int(len(ms) * 0.9)], ms[min(len(ms) - 1, int(len(ms) * 0.99))], ms[-1]))
+    print("  statuses %s  errors %d  reconnects %d" % (
+        " ".join("%d:%d" % kv for kv in sorted(statuses.items())) or "-",
+        sum(w.errors for w in workers), sum(w.reconnects for w in workers)))
+    return len(latencies) / elapsed
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test the 7sClock JSON API")
+    parser.add_argument("host")
+    parser.add_argument("--mode", choices=["close", "keepalive", "pipeline"], default="keepalive")
+    parser.add_argument("--port", type=int, help="default 80 for close, 8080 otherwise")
+    parser.add_argument("--path", default="/api/metrics")
+    parser.add_argument("--concurrency", type=int, default=2, help="parallel connections (default 2)")
+    parser.add_argument("--depth", type=int, default=4, help="requests per batch in pipeline mode (default 4)")
+    parser.add_argument("--duration", type=float, default=10, help="seconds per run (default 10)")
+    parser.add_argument("--timeout", type=float, default=5)
+    parser.add_argument("--compare", action="store_true", help="run close, then keepalive, and print the speedup")
+    args = parser.parse_args()
+    if args.compare:
+        close = run(args, "close")
+        keep = run(args, "keepalive")
+        if close:
+            print("keep-alive speedup: %.2fx" % (keep / close))
+    else:
+        run(args, args.mode)
+
+
+if __name__ == "__main__":
+    main()